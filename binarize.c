@@ -19,413 +19,1454 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _DEFAULT_SOURCE      /* fsync() */
 #include <cblas.h>
-#include <ctype.h>
 #include <math.h>
+#include <pthread.h>         /* pthread_create(), pthread_join() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#define MAXWORDLEN 256      /* buffer size when reading words of embedding */
+#include <unistd.h>          /* fsync() */
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+#define MAXWORDLEN 256      /* buffer size of filenames */
+#define ENCODE_CHUNK 4096   /* number of vectors encoded at once */
+#define WORKSPACE_ALIGN 64  /* alignment of the training buffers (bytes) */
+#define MAXTHREADS 256      /* maximum number of encoding threads */
+
+/* Model file, written with `-save-model` and read with `-encode`: a `struct
+ * model_header`, followed by the (n_bits, n_dims) matrix W then the (n_dims)
+ * vector C, as floats in the byte order of the machine (given by `endian`). */
+#define MODEL_MAGIC   "NLBMODEL"
+#define MODEL_VERSION 1
+
+struct model_header
+{
+	char magic[8];          /* MODEL_MAGIC, without the null character */
+	unsigned int version;   /* MODEL_VERSION */
+	unsigned int endian;    /* BIN_ENDIAN */
+	int n_dims;             /* dimension of the real-value vectors */
+	int n_bits;             /* number of bits of the binary vectors */
+};
+
+/* the learned projection: latent = W.x, reconstruction = tanh(W'.latent + C) */
+struct model
+{
+	int n_dims, n_bits;
+	float *W;               /* (n_bits, n_dims) matrix */
+	float *C;               /* (n_dims) vector */
+};
+
+/* Checkpoint file, written with `-checkpoint` and read with `-resume`: a
+ * `struct checkpoint_header` (where training stopped), followed by W and C like
+ * in a model file. */
+#define CHECKPOINT_MAGIC   "NLBCHKPT"
+#define CHECKPOINT_VERSION 1
+
+/* where training is: the next batch starts at vector `offset` of epoch `epoch`,
+ * and is trained with learning rates `lr_rec` and `lr_reg` */
+struct train_state
+{
+	int epoch;
+	long offset;
+	float lr_rec, lr_reg;
+};
 
-int getc_unlocked(FILE *);
+struct checkpoint_header
+{
+	char magic[8];          /* CHECKPOINT_MAGIC, without null character */
+	unsigned int version;   /* CHECKPOINT_VERSION */
+	unsigned int endian;    /* BIN_ENDIAN */
+	int n_dims, n_bits;     /* dimensions of the model */
+	long n_vecs;            /* training parameters, to check that the */
+	int batch_size;         /* resumed training is the same one */
+	struct train_state state;
+};
+
+/* when checkpoints are written during training */
+struct checkpoint
+{
+	char *filename;         /* NULL to never write a checkpoint */
+	int every_epochs;       /* after every N epochs (0 to disable) */
+	long every_batches;     /* after every N batches (0 to disable) */
+};
+
+/* Evaluation of the model during training, with `-eval-every`: the real-value
+ * vectors of the words of the evaluation datasets are copied once before
+ * training, then encoded with the current weights after every N epochs and
+ * evaluated like similarity_binary does, without writing any file. Row i of
+ * the matrices is the word of index i in hashtab. */
+struct evaluation
+{
+	char *dirname;          /* directory of the evaluation datasets */
+	int every_epochs;       /* after every N epochs (0 to disable) */
+	float *vec;             /* (n_words, n_dims) real-value vectors */
+	unsigned long *codes;   /* (n_words, n_long) their binary vectors */
+	char *has_vector;       /* whether each word has a vector */
+};
+
+/* Batches of a shuffled epoch, gathered by a producer thread into a double
+ * buffer while the previous batch is trained. Each buffer is either full
+ * (gathered, not trained yet) or free. */
+struct prefetch
+{
+	struct vec_source *src;
+	int epoch, batch_size;
+	long offset;            /* position in the epoch of the first batch */
+	float *batch[2];        /* (batch_size, n_dims) buffers */
+	int full[2];
+	int next;               /* buffer of the next batch to train */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;    /* signaled when a buffer is filled or freed */
+	pthread_t thread;
+};
+
+/* Data-parallel training: each global batch is split into one shard per
+ * thread, the main thread being thread 0. With synchronized updates, each
+ * thread computes the gradients of its shard into its own buffers, then the
+ * threads reduce them (each one a part of the rows of W), always adding the
+ * shards in the same order, so the result does not depend on the scheduling.
+ * With Hogwild updates, each thread directly updates W and C, without locks. */
+struct trainer
+{
+	struct model *model;
+	int n_threads;
+	int hogwild;
+	struct train_ctx *ctx;  /* buffers of each thread */
+	const float *batch;     /* the current global batch */
+	long n;                 /* its number of vectors */
+	long shard;             /* number of vectors of each (full) shard */
+	float lr_rec;
+	int stop;               /* set to make the threads exit */
+	pthread_barrier_t barrier;
+	pthread_t *threads;
+	struct train_thread *args;
+};
+
+/* what a training thread needs to know: its trainer and its number */
+struct train_thread
+{
+	struct trainer *tr;
+	int id;
+};
+
+/* where the binary vectors are written, one chunk after another. With the
+ * packed format, the codes and the words are written in two different
+ * sections of the file, so each one has its own position. */
+struct vec_writer
+{
+	FILE *fp;
+	int packed;             /* packed binary format, or text */
+	int n_bits;
+	long n_vecs;            /* number of vectors announced in the header */
+	long n_written;         /* number of vectors already written */
+	struct bin_header header;
+	long words_pos;         /* where the next word is written (packed) */
+};
+
+/* buffers of a training step, allocated once (aligned on WORKSPACE_ALIGN
+ * bytes) for batches of at most max_batch vectors, and the kernels of its
+ * elementwise passes */
+struct train_ctx
+{
+	int n_dims, n_bits, max_batch;
+	float *T;               /* (n_dims, n_dims) matrix W'.W - I */
+	float *latent;          /* (batch, n_bits) matrix bin(x.W') */
+	float *x_hat;           /* (batch, n_dims) reconstruction, then the
+	                           gradient of the loss w.r.t. it */
+	float *dldC;            /* (n_dims) gradient w.r.t. C */
+	float *dW;              /* (n_bits, n_dims) gradient w.r.t. W, only for
+	                           data-parallel training (else NULL) */
+	void (*binarize_latent)(float*, const long);
+	void (*reconstruction_error)(float*, const float*, const float*,
+	                             float*, const int, const int);
+};
 
-/* read a word from ̣`fp` into `buffer`; read at most MAXWORDLEN characters */
-void read_word(FILE *fp, char **buffer)
+/* return a new memory allocated array of random floats, normalized to 1 */
+float *random_array(long size)
 {
-	static char tmp[MAXWORDLEN];
-	static size_t len;
-	int i = 0;
+	float *ar, norm;
+	long i;
 
-	/* skip white spaces (space or line feed (ascii code 0x0a)) */
-	while (isspace((tmp[i] = getc_unlocked(fp))))
-		;
+	ar = calloc(size, sizeof *ar);
 
-	++i; /* move one position because tmp[i] is not a white space */
-	while ((tmp[i] = getc_unlocked(fp)) != ' ' && i < MAXWORDLEN-1)
-		++i;
-	tmp[i] = '\0';
+	/* initalize ar with random float values in [-0.5, 0.5] */
+	for (i = 0, norm = 0.0f; i < size; ++i)
+	{
+		ar[i] = ((float) rand() / RAND_MAX) - 0.5f;
+		norm += ar[i] * ar[i];
+	}
 
-	/* copy tmp into buffer; need to allocate memory for that */
-	len = strlen(tmp);
-	if ((*buffer = malloc(len + 1)) == NULL)
+	norm = sqrt(norm);
+	/* normalize ar */
+	for (i = 0; i < size; ++i)
+		ar[i] /= norm;
+	return ar;
+}
+
+/* DEFINE_STEP_KERNELS: define the elementwise passes of a training step, with
+ *                      `attr` prepended to their definitions to compile them
+ *                      for a specific instruction set. Their loops have no
+ *                      branches nor dependencies between iterations, so the
+ *                      compiler vectorizes them for the width of this set.
+ *   - binarize: replace each of the `size` values by 1 if it is positive,
+ *               0 otherwise.
+ *   - error:    for each of the `batch_size` rows of `x_hat` (reconstructions
+ *               of the rows of x), add C and apply the simplified version of
+ *               tanh (-1 when v < -1; +1 when v > 1; id(v) otherwise; the
+ *               influence on the binary vectors of this approximation is
+ *               negligible), then replace it by the gradient of the loss
+ *               (v - x) * (1 - v**2), and store into dldC the sum of the
+ *               gradients of all rows. */
+#define DEFINE_STEP_KERNELS(binarize, error, attr)                          \
+attr static void binarize(float *latent, const long size)                   \
+{                                                                           \
+	long i;                                                             \
+                                                                            \
+	for (i = 0; i < size; ++i)                                          \
+		latent[i] = (latent[i] > 0) ? 1.0f : 0.0f;                  \
+}                                                                           \
+                                                                            \
+attr static void error(float *x_hat, const float *C, const float *x,        \
+                       float *dldC, const int n, const int batch_size)      \
+{                                                                           \
+	float v;                                                            \
+	int i, j;                                                           \
+                                                                            \
+	for (j = 0; j < n; ++j)                                             \
+		dldC[j] = 0;                                                \
+	for (i = 0; i < batch_size; ++i, x_hat += n, x += n)                \
+		for (j = 0; j < n; ++j)                                     \
+		{                                                           \
+			v = x_hat[j] + C[j];                                \
+			v = (v < -1.0f) ? -1.0f : (v > 1.0f) ? 1.0f : v;    \
+			x_hat[j] = (v - x[j]) * (1 - v*v);                  \
+			dldC[j] += x_hat[j];                                \
+		}                                                           \
+}
+
+#define PORTABLE /* no target attribute */
+DEFINE_STEP_KERNELS(binarize_scalar, error_scalar, PORTABLE)
+
+#ifdef X86_KERNELS
+#define AVX2 __attribute__((target("avx2,fma")))
+DEFINE_STEP_KERNELS(binarize_avx2, error_avx2, AVX2)
+
+#define AVX512 __attribute__((target("avx512f")))
+DEFINE_STEP_KERNELS(binarize_avx512, error_avx512, AVX512)
+#endif
+
+/* return an array of n floats aligned on WORKSPACE_ALIGN bytes (not
+ * initialized) */
+float *alloc_workspace(size_t n)
+{
+	void *ar;
+
+	if (posix_memalign(&ar, WORKSPACE_ALIGN, n * sizeof(float)) != 0)
 	{
-		fprintf(stderr, "read_word: can't allocate memory for %s\n",
-		        tmp);
+		fprintf(stderr, "alloc_workspace: can't allocate memory\n");
 		exit(1);
 	}
-	memcpy(*buffer, tmp, len+1);
+	return ar;
 }
 
-/* read and return a float value from ̣`fp`, handle scientific notation */
-float read_float(FILE *fp)
+/* allocate the buffers of `ctx` for n_dims dimensions, n_bits bits and batches
+ * of at most max_batch vectors, choose the elementwise kernels for the widest
+ * vector instructions the CPU supports (detected with CPUID) */
+void init_train_ctx(struct train_ctx *ctx, int n_dims, int n_bits,
+		    int max_batch)
 {
-	float val, power, power_e;
-	int sign, exponent;
-	char c;
+	ctx->n_dims    = n_dims;
+	ctx->n_bits    = n_bits;
+	ctx->max_batch = max_batch;
+	ctx->T         = alloc_workspace((size_t) n_dims * n_dims);
+	ctx->latent    = alloc_workspace((size_t) max_batch * n_bits);
+	ctx->x_hat     = alloc_workspace((size_t) max_batch * n_dims);
+	ctx->dldC      = alloc_workspace(n_dims);
+	ctx->dW        = NULL;
+
+	ctx->binarize_latent      = binarize_scalar;
+	ctx->reconstruction_error = error_scalar;
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		ctx->binarize_latent      = binarize_avx512;
+		ctx->reconstruction_error = error_avx512;
+	}
+	else if (__builtin_cpu_supports("avx2")
+	      && __builtin_cpu_supports("fma"))
+	{
+		ctx->binarize_latent      = binarize_avx2;
+		ctx->reconstruction_error = error_avx2;
+	}
+#endif
+}
 
-	/* skip white spaces */
-	while (isspace((c= getc_unlocked(fp))))
-		;
+/* release the buffers of `ctx` */
+void free_train_ctx(struct train_ctx *ctx)
+{
+	free(ctx->T);
+	free(ctx->latent);
+	free(ctx->x_hat);
+	free(ctx->dldC);
+	free(ctx->dW);
+}
 
-	/* handle optional sign */
-	sign = (c == '-') ? -1 : 1;
-	if (c == '+' || c == '-')
-		c = getc_unlocked(fp);
+/* compute the gradient of the regularization w.r.t. W, update weigths of W.
+ * `ctx` gives the buffer of T. */
+void apply_regularizarion_gradient(struct train_ctx *ctx, float *W, int m,
+		                   int n, float lr_reg)
+{
+	float *T, *copy;
+	int i;
 
-	/* get integer part */
-	for (val = 0.0; isdigit(c); c = getc_unlocked(fp))
-		val = 10.0 * val + (c - '0');
+	/* T = W'.W - I;
+	 * W is a (m,n) matrix, W' is a (n,m) matrix so T is a (n,n) matrix.
+	 * sgemm() overwrites T (beta = 0), no need to clear it. */
+	T = ctx->T;
 
-	/* get decimal part */
-	if (c == '.') c = getc_unlocked(fp);
-	for (power = 1.0; isdigit(c); c = getc_unlocked(fp))
-	{
-		val = 10.0 * val + (c - '0');
-		power *= 10.0;
-	}
+	/* compute T = W'.W */
+	cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+	            n, n, m,
+	            1, W, n, W, n,
+	            0, T, n);
 
-	/* get scientific notation part */
-	if (c == 'e' || c == 'E') c = getc_unlocked(fp);
-	/* if e (or E) is followed by '-', it means we need to divide the float
-	 * value by a power of 10. Otherwise, we divide it by a power of 0.1
-	 * (i.e. multiply by a power of 10) */
-	power_e = (c == '-') ? 10 : 0.1;
-	if (c == '-' || c == '+') c = getc_unlocked(fp);
+	/* compute T = T - I */
+	for (i = 0, copy = T; i++ < n; copy = copy + n + 1)
+		*copy -= 1.0;
+
+	/* gradient matrix is dRdW = 2 * W.T, and W is updated with
+	 * W -= lr_reg * dRdW. Compute dRdW, but directly update
+	 * the weights of W (the function cblas_dgemm(A, B, C) performs the
+	 * matrix operation:  C = alpha * A.B + beta * C) */
+	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+	            m, n, n,
+	            -2 * lr_reg, W, n, T, n,
+	            1, W, n);
+}
 
-	for (exponent = 0; isdigit(c); c = getc_unlocked(fp))
-		exponent = 10 * exponent + (c - '0');
-	while (exponent-- > 0)
-		power *= power_e;
+/* compute the gradients of the reconstruction loss w.r.t C and x_hat, for the
+ * batch `embedding` (a (batch_size,n) matrix, not the whole embedding matrix).
+ * `ctx` gives the buffers (batch_size must not exceed ctx->max_batch), which
+ * hold the results: ctx->latent, the gradient w.r.t. x_hat (in ctx->x_hat) and
+ * the gradient w.r.t. C (ctx->dldC). The intermediate matrices are stored with
+ * one row per vector of the batch, like `embedding`, so the elementwise passes
+ * read all of them contiguously. */
+void reconstruction_error(struct train_ctx *ctx, const float *W, const float *C,
+		          const float *embedding, int m, int n, int batch_size)
+{
+	/* latent = bin(embedding.W') where embedding is the stacked vectors of
+	 * the batch. embedding is a (batch_size,n) matrix, W' is a (n,m)
+	 * matrix, so latent is a (batch_size,m) matrix. */
 
-	return sign * val / power;
+	/* compute latent = bin(embedding.W'). bin() is a function that maps
+	 * negative values to 0 and positive values to 1. */
+	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+	            batch_size, m, n,
+	            1, embedding, n, W, n,
+	            0, ctx->latent, m);
+	ctx->binarize_latent(ctx->latent, (long) batch_size * m);
+
+	/* x_hat = tanh(latent.W + C);
+	 * latent is a (batch_size,m) matrix, W is a (m,n) matrix so x_hat is a
+	 * (batch_size,n) matrix. C is a (n) vector and is row broadcasted (as
+	 * if C were added to each row of latent.W) */
+	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+	            batch_size, n, m,
+	            1, ctx->latent, m, W, n,
+	            0, ctx->x_hat, n);
+
+	/* in a single pass: add C, apply tanh, then replace x_hat by the
+	 * gradient (x_hat - x) * (1 - x_hat**2) and sum it over the batch into
+	 * dldC */
+	ctx->reconstruction_error(ctx->x_hat, C, embedding, ctx->dldC, n,
+	                          batch_size);
 }
 
-/* load the list of words and vectors from `filename`; return the embedding */
-float *load_embedding(const char *filename, char ***words,
-		      long *n_vecs, int *n_dims)
+/* compute the gradients of the reconstruction loss w.r.t W and C, update the
+ * weights of W and C. `embedding` should not be the whole embedding matrix, but
+ * the embedding matrix of the batch, so dimension should be (batch_size,n).
+ * `ctx` gives the buffers (batch_size must not exceed ctx->max_batch). */
+void apply_reconstruction_gradient(struct train_ctx *ctx, float *W, float *C,
+		                   const float *embedding, int m, int n,
+		                   int batch_size, float lr_rec)
 {
-	int i;
-	char c;
-	long index;
-	FILE *fp;                  /* to open the vector file */
-	float *vec;                /* to store the word vectors */
+	int j;
+
+	reconstruction_error(ctx, W, C, embedding, m, n, batch_size);
+
+	/* compute dldW = latent'.(gradient in x_hat), but since W is then
+	 * updated with W -= lr_rec * dldW, directly update the weights of W
+	 * with the result of the dot product (the function cblas_dgemm(A, B,
+	 * C) performs the matrix operation:  C = alpha * A.B + beta * C) */
+	cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+	            m, n, batch_size,
+	            -lr_rec, ctx->latent, m, ctx->x_hat, n,
+	            1, W, n);
+
+	/* update weight of C with the gradient summed over the batch */
+	for (j = 0; j < n; ++j)
+		C[j] -= lr_rec * ctx->dldC[j];
+}
 
-	if ((fp = fopen(filename, "r")) == NULL)
+/* initialize the weights of `model` for n_dims dimensions and n_bits bits */
+void init_model(struct model *model, int n_dims, int n_bits)
+{
+	/* W is a (n_bits, n_dims) matrix, C is a (n_dims) vector */
+	srand(0);
+	model->n_dims = n_dims;
+	model->n_bits = n_bits;
+	model->W = random_array(n_dims * n_bits);
+	model->C = random_array(n_dims);
+}
+
+/* write the weights of `model` and the training state into `filename`. The
+ * checkpoint is first written into a temporary file, then renamed: the
+ * previous checkpoint is only replaced by a complete one. */
+void save_checkpoint(const char *filename, const struct model *model,
+		     const struct train_state *state, long n_vecs,
+		     int batch_size)
+{
+	struct checkpoint_header header;
+	char *tmp;
+	FILE *fo;
+	size_t size_W;
+
+	if ((tmp = malloc(strlen(filename) + 5)) == NULL)
 	{
-		fprintf(stderr, "load_embedding: can't open %s\n", filename);
+		fprintf(stderr, "save_checkpoint: can't allocate memory\n");
 		exit(1);
 	}
-
-	/* n_vecs and n_dims are pointers, no need of & */
-	if (fscanf(fp, "%ld %d", n_vecs, n_dims) != 2)
+	strcpy(tmp, filename);
+	strcat(tmp, ".tmp");
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+	header.version    = CHECKPOINT_VERSION;
+	header.endian     = BIN_ENDIAN;
+	header.n_dims     = model->n_dims;
+	header.n_bits     = model->n_bits;
+	header.n_vecs     = n_vecs;
+	header.batch_size = batch_size;
+	header.state      = *state;
+
+	/* the data must be on disk before the rename is */
+	size_W = (size_t) model->n_bits * model->n_dims;
+	if ((fo = fopen(tmp, "wb")) == NULL
+	 || fwrite(&header, sizeof header, 1, fo) != 1
+	 || fwrite(model->W, sizeof *model->W, size_W, fo) != size_W
+	 || fwrite(model->C, sizeof *model->C, model->n_dims, fo)
+	    != (size_t) model->n_dims
+	 || fflush(fo) != 0 || fsync(fileno(fo)) != 0 || fclose(fo) != 0
+	 || rename(tmp, filename) != 0)
 	{
-		fprintf(stderr, "load_embedding: first line of %s should "
-		        "contain the number of words in file and the dimension "
-		        "of vectors\n", filename);
+		fprintf(stderr, "save_checkpoint: can't write %s\n", filename);
 		exit(1);
 	}
+	free(tmp);
+}
 
-	/* `words` is supposed to be an array of strings (so char**) but we are
-	 * passing it by reference to directly modify the variable passed as a
-	 * parameter, so one more level of indirection (that's why it is
-	 * char***). `*word` is the content of the passed pointer (the actual
-	 * array of strings) */
-	if ((*words = calloc(*n_vecs, sizeof **words)) == NULL)
+/* read the weights of `model` (already allocated) and the training state from
+ * `filename`; return 0 if the file does not exist */
+int load_checkpoint(const char *filename, struct model *model,
+		    struct train_state *state, long n_vecs, int batch_size)
+{
+	struct checkpoint_header header;
+	FILE *fi;
+	size_t size_W;
+
+	if ((fi = fopen(filename, "rb")) == NULL)
+		return 0;
+
+	if (fread(&header, sizeof header, 1, fi) != 1
+	 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof header.magic) != 0
+	 || header.endian != BIN_ENDIAN || header.version > CHECKPOINT_VERSION)
+	{
+		fprintf(stderr, "load_checkpoint: %s is not a checkpoint written"
+		        " on this machine\n", filename);
+		exit(1);
+	}
+	if (header.n_dims != model->n_dims || header.n_bits != model->n_bits
+	 || header.n_vecs != n_vecs || header.batch_size != batch_size)
 	{
-		fprintf(stderr, "load_embedding: can't allocate memory for "
-		        "words\n");
+		fprintf(stderr, "load_checkpoint: %s has been written for "
+		        "another training (%ld vectors of %d dimensions, %d bits,"
+		        " batches of %d)\n", filename, header.n_vecs,
+		        header.n_dims, header.n_bits, header.batch_size);
 		exit(1);
 	}
 
-	if ((vec = calloc(*n_vecs * *n_dims, sizeof *vec)) == NULL)
+	size_W = (size_t) model->n_bits * model->n_dims;
+	if (fread(model->W, sizeof *model->W, size_W, fi) != size_W
+	 || fread(model->C, sizeof *model->C, model->n_dims, fi)
+	    != (size_t) model->n_dims)
 	{
-		fprintf(stderr, "load_embedding: can't allocate memory for "
-		        "embedding\n");
+		fprintf(stderr, "load_checkpoint: %s is truncated\n", filename);
 		exit(1);
 	}
+	*state = header.state;
+	fclose(fi);
+	return 1;
+}
 
-	/* Start reading the word and vector values. */
-	index = 0;
-	while (index < *n_vecs) /* Stop when enough vectors have been loaded. */
-	{
-		/* Sometimes, for some word embedding files, after reading the
-		 * last value of the last line, the end-of-file indicator is not
-		 * set. According to the documentation of feof():
-		 *   "Notice that stream's internal position indicator may point
-		 *   to the end-of-file for the next operation, but still, the
-		 *   end-of-file indicator may not be set until an operation
-		 *   attempts to read at that point."
-		 * So I make sure that EOF is not reached by reading a char. */
-		c = getc_unlocked(fp);
-		if (c == EOF)
-		{
-			fprintf(stderr, "load_embedding: EOF reached. Only %ld "
-			        "vectors loaded (first line of %s indicates "
-			        "there are %ld vectors).\n", index, filename,
-			        *n_vecs);
-			exit(1);
-		}
-		ungetc(c, fp); /* there is no unlocked version of ungetc() */
-		read_word(fp, *words + index);
-		for (i = *n_dims * index; i < *n_dims * (index+1); ++i)
-			vec[i] = read_float(fp);
-		++index;
+/* return the next value of the pseudo-random generator of state *x
+ * (splitmix64); results only depend on the initial state, not on rand() */
+unsigned long next_random(unsigned long *x)
+{
+	unsigned long z;
+
+	z = (*x += 0x9E3779B97F4A7C15UL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+	return z ^ (z >> 31);
+}
+
+/* randomly permute the n values of `a` (Fisher-Yates), with a generator
+ * initialized with `seed` */
+void shuffle_array(long *a, long n, unsigned long seed)
+{
+	long i, j, tmp;
+
+	for (i = n - 1; i > 0; --i)
+	{
+		j = next_random(&seed) % (i + 1);
+		tmp  = a[i];
+		a[i] = a[j];
+		a[j] = tmp;
 	}
+}
 
-	fclose(fp);
-	return vec;
+/* wait until buffer k of `pf` is in state `full` */
+void wait_buffer(struct prefetch *pf, int k, int full)
+{
+	pthread_mutex_lock(&pf->lock);
+	while (pf->full[k] != full)
+		pthread_cond_wait(&pf->cond, &pf->lock);
+	pthread_mutex_unlock(&pf->lock);
 }
 
-/* free the memory used to store the list of words */
-void destroy_word_list(char **words, long n_vecs)
+/* set buffer k of `pf` in state `full`, wake up the thread waiting for it */
+void set_buffer(struct prefetch *pf, int k, int full)
 {
-	/* each cell of `words` is a string created with strdup. Need to free
-	 * the memory allocated for each cell */
-	while (n_vecs--)
-		free(words[n_vecs]);
-	free(words);
+	pthread_mutex_lock(&pf->lock);
+	pf->full[k] = full;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
 }
 
-/* return a new memory allocated array of random floats, normalized to 1 */
-float *random_array(long size)
+/* Producer thread: gather the rows of the epoch, from position pf->offset, in
+ * the shuffled order, into batches of batch_size rows (the last one has the
+ * remaining rows), alternately in each buffer. Rows are shuffled by blocks of
+ * the size of the window of the source (all rows if they are in memory): the
+ * order of the blocks is shuffled, then the rows inside each block, so a float
+ * cache is still read one window at a time. The order only depends on the
+ * epoch, so a resumed training sees the same batches. */
+void *gather_batches(void *arg)
 {
-	float *ar, norm;
-	long i;
+	struct prefetch *pf = arg;
+	long *blocks, *rows, n_vecs, block_size, n_blocks, size, b, i, pos;
+	int k, n_dims, filled;
+
+	n_vecs = pf->src->n_vecs;
+	n_dims = pf->src->n_dims;
+	block_size = (pf->src->fd < 0) ? n_vecs : pf->src->window_size;
+	n_blocks = (n_vecs + block_size - 1) / block_size;
+	if ((blocks = malloc(n_blocks * sizeof *blocks)) == NULL
+	 || (rows = malloc(block_size * sizeof *rows)) == NULL)
+	{
+		fprintf(stderr, "gather_batches: can't allocate memory\n");
+		exit(1);
+	}
+	for (b = 0; b < n_blocks; ++b)
+		blocks[b] = b;
+	shuffle_array(blocks, n_blocks, pf->epoch);
 
-	ar = calloc(size, sizeof *ar);
+	for (b = 0, pos = 0, k = 0, filled = 0; b < n_blocks; ++b, pos += size)
+	{
+		size = (n_vecs - blocks[b] * block_size < block_size)
+		       ? n_vecs - blocks[b] * block_size : block_size;
+		if (pos + size <= pf->offset)
+			continue;
+
+		for (i = 0; i < size; ++i)
+			rows[i] = blocks[b] * block_size + i;
+		shuffle_array(rows, size, (unsigned long) pf->epoch << 32
+		                          ^ (blocks[b] + 1));
+		for (i = (pf->offset > pos) ? pf->offset - pos : 0; i < size;
+		     ++i)
+		{
+			if (filled == 0)
+				wait_buffer(pf, k, 0);
+			memcpy(pf->batch[k] + filled * n_dims,
+			       get_rows(pf->src, rows[i], 1),
+			       n_dims * sizeof *pf->batch[k]);
+			if (++filled == pf->batch_size)
+			{
+				set_buffer(pf, k, 1);
+				k ^= 1;
+				filled = 0;
+			}
+		}
+	}
+	if (filled > 0)
+		set_buffer(pf, k, 1);
 
-	/* initalize ar with random float values in [-0.5, 0.5] */
-	for (i = 0, norm = 0.0f; i < size; ++i)
+	free(blocks);
+	free(rows);
+	return NULL;
+}
+
+/* start gathering the batches of `epoch` from position `offset` (buffers are
+ * allocated by the caller) */
+void start_prefetch(struct prefetch *pf, int epoch, long offset)
+{
+	pf->epoch   = epoch;
+	pf->offset  = offset;
+	pf->full[0] = pf->full[1] = 0;
+	pf->next    = 0;
+	if (pthread_create(&pf->thread, NULL, gather_batches, pf) != 0)
 	{
-		ar[i] = ((float) rand() / RAND_MAX) - 0.5f;
-		norm += ar[i] * ar[i];
+		fprintf(stderr, "start_prefetch: can't create thread\n");
+		exit(1);
 	}
+}
 
-	norm = sqrt(norm);
-	/* normalize ar */
-	for (i = 0; i < size; ++i)
-		ar[i] /= norm;
-	return ar;
+/* return the next batch gathered by the producer thread */
+const float *next_batch(struct prefetch *pf)
+{
+	wait_buffer(pf, pf->next, 1);
+	return pf->batch[pf->next];
 }
 
-/* compute the gradient of the regularization w.r.t. W, update weigths of W */
-void apply_regularizarion_gradient(float *W, int m, int n, float lr_reg)
+/* give back to the producer thread the buffer of the batch just trained */
+void release_batch(struct prefetch *pf)
 {
-	float *T, *copy;
-	int i;
+	set_buffer(pf, pf->next, 0);
+	pf->next ^= 1;
+}
 
-	/* T = W'.W - I;
-	 * W is a (m,n) matrix, W' is a (n,m) matrix so T is a (n,n) matrix */
-	T = calloc(n * n, sizeof *T);
+/* return the number of vectors of shard t of the current batch of `tr`; shards
+ * are filled in order, so only the last ones can be empty */
+long shard_size(const struct trainer *tr, int t)
+{
+	long first;
 
-	/* compute T = W'.W */
-	cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
-	            n, n, m,
-	            1, W, n, W, n,
-	            0, T, n);
+	first = t * tr->shard;
+	if (first >= tr->n)
+		return 0;
+	return (tr->n - first < tr->shard) ? tr->n - first : tr->shard;
+}
 
-	/* compute T = T - I */
-	for (i = 0, copy = T; i++ < n; copy = copy + n + 1)
-		*copy -= 1.0;
+/* train the shard t of the current batch of `tr`: update W and C (Hogwild), or
+ * compute its gradients into the buffers of thread t */
+void train_shard(struct trainer *tr, int t)
+{
+	struct model *model = tr->model;
+	struct train_ctx *ctx = tr->ctx + t;
+	const float *shard;
+	long size;
+
+	if ((size = shard_size(tr, t)) == 0)
+		return;
+	shard = tr->batch + t * tr->shard * model->n_dims;
+	if (tr->hogwild)
+	{
+		apply_reconstruction_gradient(ctx, model->W, model->C, shard,
+		                              model->n_bits, model->n_dims,
+		                              size, tr->lr_rec);
+		return;
+	}
 
-	/* gradient matrix is dRdW = 2 * W.T, and W is updated with
-	 * W -= lr_reg * dRdW. Compute dRdW, but directly update
-	 * the weights of W (the function cblas_dgemm(A, B, C) performs the
-	 * matrix operation:  C = alpha * A.B + beta * C) */
-	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-	            m, n, n,
-	            -2 * lr_reg, W, n, T, n,
-	            1, W, n);
+	/* dldW = latent'.(gradient in x_hat) */
+	reconstruction_error(ctx, model->W, model->C, shard, model->n_bits,
+	                     model->n_dims, size);
+	cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+	            model->n_bits, model->n_dims, size,
+	            1, ctx->latent, model->n_bits, ctx->x_hat, model->n_dims,
+	            0, ctx->dW, model->n_dims);
+}
 
-	free(T);
-	return;
+/* add the gradients of all the shards of the current batch of `tr` (in the
+ * order of the shards) for the part t of the rows of W, update these rows. The
+ * thread 0 also updates C. */
+void reduce_shards(struct trainer *tr, int t)
+{
+	struct model *model = tr->model;
+	float *sum, *grad;
+	long i, first, last;
+	int u, n_dims;
+
+	n_dims = model->n_dims;
+	first  = (long) model->n_bits * t / tr->n_threads * n_dims;
+	last   = (long) model->n_bits * (t+1) / tr->n_threads * n_dims;
+
+	/* the gradients are summed into the buffer of shard 0 (never empty) */
+	sum = tr->ctx[0].dW;
+	for (u = 1; u < tr->n_threads && shard_size(tr, u) > 0; ++u)
+		for (grad = tr->ctx[u].dW, i = first; i < last; ++i)
+			sum[i] += grad[i];
+	for (i = first; i < last; ++i)
+		model->W[i] -= tr->lr_rec * sum[i];
+
+	if (t != 0)
+		return;
+	sum = tr->ctx[0].dldC;
+	for (u = 1; u < tr->n_threads && shard_size(tr, u) > 0; ++u)
+		for (grad = tr->ctx[u].dldC, i = 0; i < n_dims; ++i)
+			sum[i] += grad[i];
+	for (i = 0; i < n_dims; ++i)
+		model->C[i] -= tr->lr_rec * sum[i];
 }
 
-/* compute the gradients of the reconstruction loss w.r.t W and C, update the
- * weights of W and C. `embedding` should not be the whole embedding matrix, but
- * the embedding matrix of the batch, so dimension should be (batch_size,n). */
-void apply_reconstruction_gradient(float *W, float *C, float *embedding,
-		                   int m, int n, int batch_size, float lr_rec)
+/* Training thread (thread 0 is the main one, see train_batch()): for each
+ * batch, train its shard, then reduce its part of the gradients. The barriers
+ * separate the steps: batch ready, gradients computed, weights updated. */
+void *train_worker(void *arg)
 {
-	float *latent, *x_hat, *dldC, v;
-	int i, j;
+	struct train_thread *w = arg;
+	struct trainer *tr = w->tr;
 
-	/* latent = bin(W.embedding') where x is the stacked vectors of the
-	 * batch. W is a (m,n) matrix, embedding is a (batch_size,n) matrix, so
-	 * latent is a (m,batch_size) matrix. */
-	latent = calloc(m * batch_size, sizeof *latent);
+	for (;;)
+	{
+		pthread_barrier_wait(&tr->barrier);
+		if (tr->stop)
+			return NULL;
+		train_shard(tr, w->id);
+		pthread_barrier_wait(&tr->barrier);
+		if (!tr->hogwild)
+		{
+			reduce_shards(tr, w->id);
+			pthread_barrier_wait(&tr->barrier);
+		}
+	}
+}
 
-	/* compute latent = bin(W.embedding'). bin() is a function that maps
-	 * negative values to 0 and positive values to 1. */
-	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
-	            m, batch_size, n,
-	            1, W, n, embedding, n,
-	            0, latent, batch_size);
-	for (i = 0; i < m * batch_size; ++i)
-		latent[i] = (latent[i] > 0) ? 1.0 : 0.0;
-
-	/* x_hat = tanh(W'.latent + C);
-	 * W' is a (n,m) matrix, latent is a (m,batch_size) matrix so x_hat is a
-	 * (n,batch_size) matrix. C is a (n) vector and is column broadcasted.
-	 * (as if C were added to each column of W'.latent) */
-	x_hat = calloc(n * batch_size, sizeof *x_hat);
-
-	/* compute x_hat = W'.latent */
-	cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
-	            n, batch_size, m,
-	            1, W, n, latent, batch_size,
-	            0, x_hat, batch_size);
+/* train the n vectors of `batch` (at most n_threads * shard vectors) with the
+ * threads of `tr` */
+void train_batch(struct trainer *tr, const float *batch, long n, float lr_rec)
+{
+	tr->batch  = batch;
+	tr->n      = n;
+	tr->lr_rec = lr_rec;
+	pthread_barrier_wait(&tr->barrier);
+	train_shard(tr, 0);
+	pthread_barrier_wait(&tr->barrier);
+	if (!tr->hogwild)
+	{
+		reduce_shards(tr, 0);
+		pthread_barrier_wait(&tr->barrier);
+	}
+}
 
-	/* compute x_hat = tanh(x_hat + C). Use the simplified version of tanh
-	 * for faster computations (-1 when x < -1; +1 when x > 1; id(x)
-	 * otherwise). The differences between tanh and the simplified version
-	 * are small; the influence on the binary vectors is negligible. */
-	for (i = 0; i < n * batch_size; ++i)
+/* start the n_threads-1 threads (plus the main one) of `tr` to train `model`
+ * on shards of at most `shard` vectors */
+void start_trainer(struct trainer *tr, struct model *model, int n_threads,
+		   int hogwild, int shard)
+{
+	int t;
+
+	tr->model     = model;
+	tr->n_threads = n_threads;
+	tr->hogwild   = hogwild;
+	tr->shard     = shard;
+	tr->stop      = 0;
+	if ((tr->ctx = malloc(n_threads * sizeof *tr->ctx)) == NULL
+	 || (tr->threads = malloc(n_threads * sizeof *tr->threads)) == NULL
+	 || (tr->args = malloc(n_threads * sizeof *tr->args)) == NULL)
 	{
-		x_hat[i] = x_hat[i] + C[i / batch_size];
-		if (x_hat[i] < -1.0)
-			x_hat[i] = -1.0;
-		else if (x_hat[i] > 1.0)
-			x_hat[i] = 1.0;
+		fprintf(stderr, "start_trainer: can't allocate memory\n");
+		exit(1);
+	}
+	for (t = 0; t < n_threads; ++t)
+	{
+		init_train_ctx(tr->ctx + t, model->n_dims, model->n_bits,
+		               shard);
+		if (!hogwild)
+			tr->ctx[t].dW = alloc_workspace((size_t) model->n_bits
+			                                * model->n_dims);
 	}
 
-	/* dldC = (x_hat' - x) * (1 - x_hat'**2)
-	 * No BLAS subroutines implement element-wise matrices substraction,
-	 * have to do it manually. */
-	dldC = calloc(batch_size * n, sizeof *dldC);
-	for (i = 0; i < batch_size; ++i)
-		for (j = 0; j < n; ++j)
+	pthread_barrier_init(&tr->barrier, NULL, n_threads);
+	for (t = 1; t < n_threads; ++t)
+	{
+		tr->args[t].tr = tr;
+		tr->args[t].id = t;
+		if (pthread_create(tr->threads + t, NULL, train_worker,
+		                   tr->args + t) != 0)
 		{
-			v = x_hat[j*batch_size + i]; /* = x_hat'[i][j] */
-			dldC[i*n + j] = (v - embedding[i*n + j]) * (1 - v*v);
+			fprintf(stderr, "start_trainer: can't create thread\n");
+			exit(1);
 		}
+	}
+}
 
-	/* compute dldW = latent.dldC,  but since W is then updated with
-	 * W -= lr_rec * dldW, directly update the weights of W with the result
-	 * of the dot product (the function cblas_dgemm(A, B, C) performs the
-	 * matrix operation:  C = alpha * A.B + beta * C) */
-	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-	            m, n, batch_size,
-	            -lr_rec, latent, batch_size, dldC, n,
-	            1, W, n);
+/* make the threads of `tr` exit, release its memory */
+void stop_trainer(struct trainer *tr)
+{
+	int t;
+
+	tr->stop = 1;
+	pthread_barrier_wait(&tr->barrier);
+	for (t = 1; t < tr->n_threads; ++t)
+		pthread_join(tr->threads[t], NULL);
+	for (t = 0; t < tr->n_threads; ++t)
+		free_train_ctx(tr->ctx + t);
+	pthread_barrier_destroy(&tr->barrier);
+	free(tr->ctx);
+	free(tr->threads);
+	free(tr->args);
+}
 
-	/* update weight of C. dldC is a (batch_size,n) matrix. Each weights
-	 * C[i] is updated with the sum of the column i in dldC */
-	for (i = 0; i < batch_size; ++i)
-		for (j = 0; j < n; ++j)
-			C[j] -= lr_rec * dldC[i*n + j];
+/* store into `binary_vector` the bits of the n binary vectors of n_bits bits
+ * whose latent representations are the (n, n_bits) matrix `latent`: the j-th
+ * bit of a vector is 1 if the j-th value of its latent representation is
+ * positive. Bits are grouped by pack of 64 (a `long`), the first bit of a pack
+ * being its most significant one. */
+void pack_signs_scalar(const float *latent, long n, int n_bits,
+		       unsigned long *binary_vector)
+{
+	unsigned long bits_group;
+	long i;
+	int j;
 
-	free(latent);
-	free(x_hat);
-	free(dldC);
+	for (i = 0; i < n * (n_bits / 64); ++i, latent += 64)
+	{
+		for (bits_group = 0, j = 0; j < 64; ++j)
+			bits_group = (bits_group << 1) | (latent[j] > 0);
+		binary_vector[i] = bits_group;
+	}
 }
 
-/* transform the real-value word vectors of `embedding` into binary vectors */
-unsigned long *binarize(float *embedding, long n_vecs, int n_dims, int n_bits,
-		        float lr_rec, float lr_reg, int batch_size, int n_iter)
+#ifdef X86_KERNELS
+/* pack_signs_avx2: same as pack_signs_scalar(), with AVX2. The 8 signs of 8
+ *                  floats are given at once by a comparison and a movemask,
+ *                  the floats being first reversed so that the first one gives
+ *                  the most significant bit of the byte. */
+__attribute__((target("avx2")))
+void pack_signs_avx2(const float *latent, long n, int n_bits,
+		     unsigned long *binary_vector)
 {
-	float *latent, *W, *C;
-	unsigned long *binary_vector, bits_group;
-	int i, j, n_long;
-
-	/* W is a (n_bits, n_dims) matrix, C is a (n_dims) vector */
-	srand(0);
-	W = random_array(n_dims * n_bits);
-	C = random_array(n_dims);
+	const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256 zero = _mm256_setzero_ps();
+	unsigned long bits_group;
+	__m256 v;
+	long i;
+	int q;
 
-	for (i = 0; i < n_iter; ++i) /* for each iteration */
+	for (i = 0; i < n * (n_bits / 64); ++i, latent += 64)
 	{
-		for (j = 0; j + batch_size - 1 < n_vecs; j += batch_size)
+		for (bits_group = 0, q = 0; q < 64; q += 8)
 		{
-			apply_regularizarion_gradient(W, n_bits, n_dims, lr_reg);
-			apply_reconstruction_gradient(W, C, embedding+j*n_dims,
-			    n_bits, n_dims, batch_size, lr_rec);
+			v = _mm256_loadu_ps(latent + q);
+			v = _mm256_permutevar8x32_ps(v, reverse);
+			bits_group = (bits_group << 8) | (unsigned int)
+			    _mm256_movemask_ps(_mm256_cmp_ps(v, zero,
+			                                     _CMP_GT_OQ));
 		}
+		binary_vector[i] = bits_group;
+	}
+}
+#endif
+
+/* rows encoded by one thread of encode_vectors() */
+struct encode_job
+{
+	const struct model *model;
+	const float *embedding; /* the (n, n_dims) real-value vectors */
+	long n;
+	unsigned long *binary_vector;
+	void (*pack)(const float*, long, int, unsigned long*);
+};
+
+/* encode the rows of a `struct encode_job` by chunks of ENCODE_CHUNK, so the
+ * latent representations only need a constant amount of memory. Used as a
+ * thread routine, so it takes and returns a void pointer. */
+void *encode_rows(void *arg)
+{
+	struct encode_job *job = arg;
+	const struct model *model = job->model;
+	float *latent;
+	long first, n;
+	int n_long;
+
+	/* Each binary vector is represented as a sequence of `long` so if the
+	 * binary vectors have 256 bits and a `long` has a length of 64 bits,
+	 * then each binary vector is an array of 4 `long` (4 * 64 = 256). The
+	 * bit representation of each long are the bits of the vectors. */
+	n_long = model->n_bits / (sizeof(long) * 8);
+	latent = alloc_workspace((size_t) ENCODE_CHUNK * model->n_bits);
+
+	for (first = 0; first < job->n; first += ENCODE_CHUNK)
+	{
+		/* the j-th bit of the i-th word is determined by the sign of
+		 * the j-th value of the latent representation of the i-th
+		 * embedding vector, which is the dot product between the
+		 * original embedding and W */
+		n = (job->n - first < ENCODE_CHUNK) ? job->n - first
+		                                    : ENCODE_CHUNK;
+		cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+		            n, model->n_bits, model->n_dims,
+		            1, job->embedding + first * model->n_dims,
+		            model->n_dims, model->W, model->n_dims,
+		            0, latent, model->n_bits);
+		job->pack(latent, n, model->n_bits,
+		          job->binary_vector + first * n_long);
+	}
+
+	free(latent);
+	return NULL;
+}
+
+/* compute into `binary_vector` the binary vectors of the n_vecs real-value
+ * vectors of `embedding` with the weights W of `model`. The vectors are split
+ * into n_threads parts of consecutive rows, each one encoded by its thread. The
+ * signs are packed with vector instructions if the CPU supports them. */
+void encode_vectors(const struct model *model, const float *embedding,
+		    long n_vecs, unsigned long *binary_vector, int n_threads)
+{
+	struct encode_job jobs[MAXTHREADS];
+	pthread_t threads[MAXTHREADS];
+	void (*pack)(const float*, long, int, unsigned long*);
+	long first, last;
+	int t, n_long;
+
+	pack = pack_signs_scalar;
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		pack = pack_signs_avx2;
+#endif
+
+	n_long = model->n_bits / (sizeof(long) * 8);
+	if (n_threads > MAXTHREADS)
+		n_threads = MAXTHREADS;
+	for (t = 0; t < n_threads; ++t)
+	{
+		first = n_vecs * t / n_threads;
+		last  = n_vecs * (t+1) / n_threads;
+		jobs[t].model         = model;
+		jobs[t].embedding     = embedding + first * model->n_dims;
+		jobs[t].n             = last - first;
+		jobs[t].binary_vector = binary_vector + first * n_long;
+		jobs[t].pack          = pack;
+	}
 
-		if (j != n_vecs) /* process remaining vectors not in batch */
+	/* the calling thread encodes the first part */
+	for (t = 1; t < n_threads; ++t)
+		if (pthread_create(threads + t, NULL, encode_rows, jobs + t)
+		    != 0)
 		{
-			apply_regularizarion_gradient(W, n_bits, n_dims, lr_reg);
-			apply_reconstruction_gradient(W, C, embedding+j*n_dims,
-			    n_bits, n_dims, n_vecs-j, lr_rec);
+			fprintf(stderr, "encode_vectors: can't create "
+			        "thread\n");
+			exit(1);
 		}
+	encode_rows(jobs);
+	for (t = 1; t < n_threads; ++t)
+		pthread_join(threads[t], NULL);
+}
+
+/* prepare the evaluation of models trained on the vectors of `src`: read the
+ * words of the datasets of ev->dirname into hashtab, then copy the vectors of
+ * these words (the last one if a word has several vectors, like when they are
+ * loaded by similarity_binary) */
+void init_evaluation(struct evaluation *ev, struct vec_source *src,
+		     int n_bits)
+{
+	const float *rows;
+	char **row_words;
+	long first, n, chunk, i, index;
+	int n_dims;
 
-		lr_rec *= 0.95;
-		lr_reg *= 0.95;
+	create_vocab(ev->dirname);
+	n_dims = src->n_dims;
+	if ((ev->vec = calloc(n_words * n_dims + 1, sizeof *ev->vec)) == NULL
+	 || (ev->codes = malloc(n_words * (n_bits / 8) + 1)) == NULL
+	 || (ev->has_vector = calloc(n_words + 1, sizeof *ev->has_vector))
+	    == NULL)
+	{
+		fprintf(stderr, "init_evaluation: can't allocate memory\n");
+		exit(1);
 	}
 
-	/* compute the binary vectors with the original embedding and W. Each
-	 * binary vector is represented as a sequence of `long` so if the binary
-	 * vectors have 256 bits and a `long` has a length of 64 bits, then each
-	 * binary vector is an array of 4 `long` (4 * 64 = 256). The bit
-	 * representation of each long are the bits of the vectors. */
-	n_long = n_bits / (sizeof(long) * 8);
-	latent = calloc(n_vecs * n_bits, sizeof *latent);
-	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
-	            n_vecs, n_bits, n_dims,
-	            1, embedding, n_dims, W, n_dims,
-	            0, latent, n_bits);
-
-	binary_vector = calloc(n_vecs * n_long, sizeof *binary_vector);
-	for (i = 0; i < n_vecs; ++i)         /* for each word */
-	{
-		bits_group = 0;
-		for (j = 0; j < n_bits; ++j) /* for each bit */
-		{
-			/* the j-th bit of the i-th word is determined by the
-			 * sign of the j-th value of the latent representation
-			 * of the i-th embedding vector. This latent
-			 * representation is the dot product between the
-			 * original embedding and W. It has already been
-			 * computed and stored in latent[i][j]. */
-
-			/* bits are grouped by pack of (sizeof(long)). Add
-			 * current bit to current group */
-			bits_group <<= 1;
-			bits_group |= (latent[i*n_bits + j] > 0);
-
-			/* bits_group has enough bits to form a long, write it
-			 * to the binary vector matrix and reset it */
-			if ((j+1) % (sizeof(long) * 8) == 0)
+	/* the vectors are read by chunks, which must fit in the window of a
+	 * float cache */
+	chunk = ENCODE_CHUNK;
+	if (src->vec == NULL && src->window_size < chunk)
+		chunk = src->window_size;
+	for (first = 0; first < src->n_vecs; first += n)
+	{
+		n = (src->n_vecs - first < chunk) ? src->n_vecs - first : chunk;
+		rows = get_rows(src, first, n);
+		row_words = get_words(src, first, n);
+		for (i = 0; i < n; ++i)
+			if ((index = get_index(row_words[i])) >= 0)
 			{
-				binary_vector[i*n_long + j/(sizeof(long) * 8)] =
-					bits_group;
-				bits_group = 0;
+				memcpy(ev->vec + index * n_dims,
+				       rows + i * n_dims,
+				       n_dims * sizeof *ev->vec);
+				ev->has_vector[index] = 1;
 			}
-		}
 	}
+}
 
-	free(W);
-	free(C);
-	return binary_vector;
+/* encode the vectors of the dataset words with the current weights of `model`
+ * and print the Spearman coefficient of each dataset */
+void run_evaluation(const struct evaluation *ev, const struct model *model,
+		    int epoch, int n_threads)
+{
+	printf("Evaluation after epoch %d:\n", epoch);
+	encode_vectors(model, ev->vec, n_words, ev->codes, n_threads);
+	evaluate(ev->dirname, ev->codes, ev->has_vector,
+	         model->n_bits / (sizeof(long) * 8), binary_sim);
+	fflush(stdout);
 }
 
-/* write the binary vectors into `filename` */
-void write_binary_vectors(char *filename, char **words,
-		          unsigned long *binary_vector, long n_vecs, int n_bits)
+/* train the weights of `model` to binarize the real-value word vectors given by
+ * `src`, for n_iter epochs, starting from `state` (updated as training goes).
+ * Vectors are taken in the order of `src`, or in a different random order for
+ * each epoch if `shuffle` is set. With n_threads > 1, each batch has n_threads
+ * shards of batch_size vectors, trained in parallel (see struct trainer); since
+ * there are n_threads times less batches, the regularization is applied with a
+ * learning rate n_threads times larger. Checkpoints are written as asked by
+ * `ckpt`. */
+void train_model(struct model *model, struct vec_source *src, int batch_size,
+		 int n_iter, int shuffle, int n_threads, int hogwild,
+		 struct train_state *state, const struct checkpoint *ckpt,
+		 const struct evaluation *eval)
 {
+	struct train_ctx ctx;
+	struct prefetch pf;
+	struct trainer tr;
+	const float *batch;
+	int n_dims, n_bits;
+	long j, n, n_vecs, n_batches;
+
+	n_dims = model->n_dims;
+	n_bits = model->n_bits;
+	n_vecs = src->n_vecs;
+	n_batches = 0;
+	init_train_ctx(&ctx, n_dims, n_bits, batch_size);
+	if (n_threads > 1)
+	{
+		start_trainer(&tr, model, n_threads, hogwild, batch_size);
+		batch_size *= n_threads;
+	}
+	if (shuffle)
+	{
+		pf.src        = src;
+		pf.batch_size = batch_size;
+		pf.batch[0]   = alloc_workspace((size_t) batch_size * n_dims);
+		pf.batch[1]   = alloc_workspace((size_t) batch_size * n_dims);
+		pthread_mutex_init(&pf.lock, NULL);
+		pthread_cond_init(&pf.cond, NULL);
+	}
+
+	while (state->epoch < n_iter) /* for each iteration */
+	{
+		if (shuffle)
+			start_prefetch(&pf, state->epoch, state->offset);
+
+		/* the last batch has the remaining vectors, if n_vecs is not a
+		 * multiple of batch_size */
+		for (j = state->offset; j < n_vecs; j += n)
+		{
+			n = (n_vecs - j < batch_size) ? n_vecs - j : batch_size;
+			batch = shuffle ? next_batch(&pf) : get_rows(src, j, n);
+			apply_regularizarion_gradient(&ctx, model->W, n_bits,
+			    n_dims, state->lr_reg * n_threads);
+			if (n_threads > 1)
+				train_batch(&tr, batch, n, state->lr_rec);
+			else
+				apply_reconstruction_gradient(&ctx, model->W,
+				    model->C, batch, n_bits, n_dims, n,
+				    state->lr_rec);
+			if (shuffle)
+				release_batch(&pf);
+
+			state->offset = j + n;
+			if (ckpt->filename != NULL && ckpt->every_batches > 0
+			 && ++n_batches % ckpt->every_batches == 0)
+				save_checkpoint(ckpt->filename, model, state,
+				                n_vecs, batch_size);
+		}
+
+		if (shuffle)
+			pthread_join(pf.thread, NULL);
+		state->offset = 0;
+		state->lr_rec *= 0.95;
+		state->lr_reg *= 0.95;
+		++state->epoch;
+		if (ckpt->filename != NULL && ckpt->every_epochs > 0
+		 && state->epoch % ckpt->every_epochs == 0)
+			save_checkpoint(ckpt->filename, model, state, n_vecs,
+			                batch_size);
+		if (eval->every_epochs > 0
+		 && state->epoch % eval->every_epochs == 0)
+			run_evaluation(eval, model, state->epoch, n_threads);
+	}
+	free_train_ctx(&ctx);
+	if (n_threads > 1)
+		stop_trainer(&tr);
+	if (shuffle)
+	{
+		free(pf.batch[0]);
+		free(pf.batch[1]);
+		pthread_mutex_destroy(&pf.lock);
+		pthread_cond_destroy(&pf.cond);
+	}
+}
+
+/* write the weights of `model` into `filename` (format described at the top of
+ * this file) */
+void save_model(const char *filename, const struct model *model)
+{
+	struct model_header header;
 	FILE *fo;
-	long i;
-	int j, n_long;
 
-	if ((fo = fopen(filename, "w")) == NULL)
+	if ((fo = fopen(filename, "wb")) == NULL)
 	{
-		fprintf(stderr, "write_binary_vectors: can't open %s\n",
-		        filename);
+		fprintf(stderr, "save_model: can't open %s\n", filename);
 		exit(1);
 	}
 
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, MODEL_MAGIC, sizeof header.magic);
+	header.version = MODEL_VERSION;
+	header.endian  = BIN_ENDIAN;
+	header.n_dims  = model->n_dims;
+	header.n_bits  = model->n_bits;
+
+	if (fwrite(&header, sizeof header, 1, fo) != 1
+	 || fwrite(model->W, sizeof *model->W,
+	           (size_t) model->n_bits * model->n_dims, fo)
+	    != (size_t) model->n_bits * model->n_dims
+	 || fwrite(model->C, sizeof *model->C, model->n_dims, fo)
+	    != (size_t) model->n_dims
+	 || fclose(fo) != 0)
+	{
+		fprintf(stderr, "save_model: can't write %s\n", filename);
+		exit(1);
+	}
+}
+
+/* read the weights of `model` from `filename`, written by save_model() */
+void load_model(const char *filename, struct model *model)
+{
+	struct model_header header;
+	FILE *fi;
+
+	if ((fi = fopen(filename, "rb")) == NULL)
+	{
+		fprintf(stderr, "load_model: can't open %s\n", filename);
+		exit(1);
+	}
+
+	if (fread(&header, sizeof header, 1, fi) != 1
+	 || memcmp(header.magic, MODEL_MAGIC, sizeof header.magic) != 0
+	 || header.endian != BIN_ENDIAN || header.version > MODEL_VERSION
+	 || header.n_dims <= 0 || header.n_bits <= 0)
+	{
+		fprintf(stderr, "load_model: %s is not a model file written on "
+		        "this machine\n", filename);
+		exit(1);
+	}
+
+	model->n_dims = header.n_dims;
+	model->n_bits = header.n_bits;
+	if ((model->W = malloc((size_t) model->n_bits * model->n_dims
+	                       * sizeof *model->W)) == NULL
+	 || (model->C = malloc(model->n_dims * sizeof *model->C)) == NULL)
+	{
+		fprintf(stderr, "load_model: can't allocate memory\n");
+		exit(1);
+	}
+	if (fread(model->W, sizeof *model->W,
+	          (size_t) model->n_bits * model->n_dims, fi)
+	    != (size_t) model->n_bits * model->n_dims
+	 || fread(model->C, sizeof *model->C, model->n_dims, fi)
+	    != (size_t) model->n_dims)
+	{
+		fprintf(stderr, "load_model: %s is truncated\n", filename);
+		exit(1);
+	}
+	fclose(fi);
+}
+
+/* create `filename` to write n_vecs binary vectors of n_bits bits, with the
+ * packed binary format described in utils.h (header, aligned code matrix, word
+ * section) if `packed` is set, otherwise as text: one line per word with the
+ * word followed by its groups of bits written as decimal integers */
+void open_writer(struct vec_writer *w, char *filename, long n_vecs, int n_bits,
+		 int packed)
+{
+	struct bin_header *h = &w->header;
+	static const char padding[BIN_ALIGN];
+
+	if ((w->fp = fopen(filename, packed ? "wb" : "w")) == NULL)
+	{
+		fprintf(stderr, "open_writer: can't open %s\n", filename);
+		exit(1);
+	}
+	w->packed    = packed;
+	w->n_bits    = n_bits;
+	w->n_vecs    = n_vecs;
+	w->n_written = 0;
+
 	/* first line is the number of vectors and number of bits per vectors */
-	fprintf(fo, "%ld %d\n", n_vecs, n_bits);
+	if (!packed)
+	{
+		fprintf(w->fp, "%ld %d\n", n_vecs, n_bits);
+		return;
+	}
+
+	/* the code matrix starts at the first multiple of BIN_ALIGN after the
+	 * header, the word section directly follows the code matrix. The size
+	 * of the word section is only known once all words are written. */
+	memset(h, 0, sizeof *h);
+	memcpy(h->magic, BIN_MAGIC, sizeof h->magic);
+	h->version      = BIN_VERSION;
+	h->endian       = BIN_ENDIAN;
+	h->n_vecs       = n_vecs;
+	h->n_bits       = n_bits;
+	h->codes_offset = (sizeof *h + BIN_ALIGN - 1) / BIN_ALIGN * BIN_ALIGN;
+	h->words_offset = h->codes_offset + n_vecs
+	                  * (n_bits / (sizeof(long) * 8)) * sizeof(long);
+	w->words_pos    = h->words_offset;
+	if (fwrite(h, sizeof *h, 1, w->fp) != 1
+	 || fwrite(padding, h->codes_offset - sizeof *h, 1, w->fp) != 1)
+	{
+		fprintf(stderr, "open_writer: can't write %s\n", filename);
+		exit(1);
+	}
+}
+
+/* write the next n binary vectors (of `words`) */
+void write_vectors(struct vec_writer *w, char **words,
+		   const unsigned long *binary_vector, long n)
+{
+	long i, size;
+	int j, n_long;
+
+	n_long = w->n_bits / (sizeof(long) * 8);
+	if (w->n_written + n > w->n_vecs)
+	{
+		fprintf(stderr, "write_vectors: more vectors than announced\n");
+		exit(1);
+	}
+
+	if (!w->packed)
+		for (i = 0; i < n; ++i)
+		{
+			fprintf(w->fp, "%s", words[i]);
+			for (j = 0; j < n_long; ++j)
+				fprintf(w->fp, " %lu",
+				        binary_vector[i*n_long + j]);
+			fprintf(w->fp, "\n");
+		}
+	else
+	{
+		/* codes go at their row in the code matrix, words at the end
+		 * of the word section; each word is written with its
+		 * terminating null character */
+		size = n_long * sizeof *binary_vector;
+		if (fseek(w->fp, w->header.codes_offset + w->n_written * size,
+		          SEEK_SET) != 0
+		 || fwrite(binary_vector, size, n, w->fp) != (size_t) n
+		 || fseek(w->fp, w->words_pos, SEEK_SET) != 0)
+		{
+			fprintf(stderr, "write_vectors: can't write vectors\n");
+			exit(1);
+		}
+		for (i = 0; i < n; ++i)
+		{
+			if (fwrite(words[i], strlen(words[i]) + 1, 1, w->fp)
+			    != 1)
+			{
+				fprintf(stderr, "write_vectors: can't write "
+				        "vectors\n");
+				exit(1);
+			}
+			w->words_pos += strlen(words[i]) + 1;
+		}
+	}
+	w->n_written += n;
+}
+
+/* finish the file of `w` (write the size of the word section) and close it */
+void close_writer(struct vec_writer *w)
+{
+	if (w->n_written != w->n_vecs)
+	{
+		fprintf(stderr, "close_writer: %ld vectors written instead of "
+		        "%ld\n", w->n_written, w->n_vecs);
+		exit(1);
+	}
+	if (w->packed)
+	{
+		w->header.words_size = w->words_pos - w->header.words_offset;
+		if (fseek(w->fp, 0, SEEK_SET) != 0
+		 || fwrite(&w->header, sizeof w->header, 1, w->fp) != 1)
+		{
+			fprintf(stderr, "close_writer: can't write header\n");
+			exit(1);
+		}
+	}
+	if (fclose(w->fp) != 0)
+	{
+		fprintf(stderr, "close_writer: can't write vectors\n");
+		exit(1);
+	}
+}
+
+/* encode the vectors of `src` with `model` and write the binary vectors into
+ * `filename`, with the text format or the packed binary format depending on
+ * `packed`. Vectors are encoded and written by chunks of ENCODE_CHUNK. */
+void encode_source(const struct model *model, struct vec_source *src,
+		   char *filename, int packed, int n_threads)
+{
+	struct vec_writer w;
+	unsigned long *bin_vec;
+	long first, n, chunk;
+
+	/* each thread encodes ENCODE_CHUNK vectors of a chunk, which must fit
+	 * in the window of a float cache */
+	chunk = (long) ENCODE_CHUNK * n_threads;
+	if (src->vec == NULL && src->window_size < chunk)
+		chunk = src->window_size;
+	if ((bin_vec = malloc(chunk * (model->n_bits / 8))) == NULL)
+	{
+		fprintf(stderr, "encode_source: can't allocate memory\n");
+		exit(1);
+	}
+
+	open_writer(&w, filename, src->n_vecs, model->n_bits, packed);
+	for (first = 0; first < src->n_vecs; first += n)
+	{
+		n = (src->n_vecs - first < chunk) ? src->n_vecs - first : chunk;
+		encode_vectors(model, get_rows(src, first, n), n, bin_vec,
+		               n_threads);
+		write_vectors(&w, get_words(src, first, n), bin_vec, n);
+	}
+	close_writer(&w);
+	free(bin_vec);
+}
+
+/* encode the real-value vectors of `input_filename` with `model` and write the
+ * binary vectors into `output_filename`. The input file is read by chunks of
+ * ENCODE_CHUNK vectors, each chunk being encoded and written before the next
+ * one is read, so the memory used does not depend on the number of vectors. */
+void encode_file(const struct model *model, const char *input_filename,
+		 char *output_filename, int packed, int n_threads)
+{
+	struct vec_writer w;
+	FILE *fi;
+	char **words;
+	float *vec;
+	unsigned long *bin_vec;
+	long n_vecs, done, n, i, chunk;
+	int n_dims, binary;
+
+	if ((fi = fopen(input_filename, "rb")) == NULL)
+	{
+		fprintf(stderr, "encode_file: can't open %s\n", input_filename);
+		exit(1);
+	}
+	binary = read_embedding_size(fi, input_filename, &n_vecs, &n_dims);
+	if (n_dims != model->n_dims)
+	{
+		fprintf(stderr, "encode_file: vectors of %s have %d dimensions,"
+		        " the model expects %d\n", input_filename, n_dims,
+		        model->n_dims);
+		exit(1);
+	}
+	chunk = (long) ENCODE_CHUNK * n_threads;
+	if ((vec = malloc(chunk * n_dims * sizeof *vec)) == NULL
+	 || (bin_vec = malloc(chunk * (model->n_bits / 8))) == NULL
+	 || (words = malloc(chunk * sizeof *words)) == NULL)
+	{
+		fprintf(stderr, "encode_file: can't allocate memory\n");
+		exit(1);
+	}
 
-	for (i = 0, n_long = n_bits / (sizeof(long) * 8); i < n_vecs; ++i)
+	open_writer(&w, output_filename, n_vecs, model->n_bits, packed);
+	for (done = 0; done < n_vecs; done += n)
 	{
-		fprintf(fo, "%s", words[i]);
-		for (j = 0; j < n_long; ++j)
-			fprintf(fo, " %lu", binary_vector[i*n_long + j]);
-		fprintf(fo, "\n");
+		n = (n_vecs - done < chunk) ? n_vecs - done : chunk;
+		if (read_vectors(fi, words, vec, n, n_dims, binary) != n)
+		{
+			fprintf(stderr, "encode_file: EOF reached. Only %ld "
+			        "vectors read (first line of %s indicates "
+			        "there are %ld vectors).\n", done, input_filename,
+			        n_vecs);
+			exit(1);
+		}
+		encode_vectors(model, vec, n, bin_vec, n_threads);
+		write_vectors(&w, words, bin_vec, n);
+		for (i = 0; i < n; ++i)
+			free(words[i]);
 	}
+	close_writer(&w);
 
-	fclose(fo);
+	fclose(fi);
+	free(vec);
+	free(bin_vec);
+	free(words);
+}
+
+/* compare the binary vectors of `filename` with those of `reference` (the
+ * output of another run, e.g. with fp32 vectors) and print how much they
+ * differ. Vectors are matched by word. */
+void compare_codes(const char *filename, const char *reference)
+{
+	unsigned long *vec, *ref;
+	long n_vecs, n_ref, n_compared, n_same, i;
+	int n_bits, ref_bits, n_long, ref_long, dist;
+	char *has_vector;
+	double total;
+
+	/* the words of `filename` are added into the hashtab, so only the
+	 * vectors of these words are loaded from `reference` (the hashtab is
+	 * emptied first: it holds the words of the datasets if the model has
+	 * been evaluated during training) */
+	clear_hashtab();
+	vec = load_vectors(filename, &n_vecs, &n_bits, &n_long, NULL, 1);
+	ref = load_vectors(reference, &n_ref, &ref_bits, &ref_long,
+	                   &has_vector, 0);
+	if (ref_bits != n_bits)
+	{
+		fprintf(stderr, "compare_codes: vectors of %s have %d bits, "
+		        "those of %s have %d\n", reference, ref_bits, filename,
+		        n_bits);
+		exit(1);
+	}
+
+	for (n_compared = n_same = 0, total = 0, i = 0; i < n_vecs; ++i)
+	{
+		if (!has_vector[i])
+			continue;
+		dist = hamming(vec + i * n_long, ref + i * n_long, n_long);
+		total += dist;
+		n_same += (dist == 0);
+		++n_compared;
+	}
+	if (n_compared == 0)
+		printf("No common word with %s.\n", reference);
+	else
+		printf("Compared to %s (%ld vectors): %.3f%% of bits differ, "
+		       "%.2f%% of vectors are identical, mean Hamming distance "
+		       "%.2f.\n", reference, n_compared,
+		       100 * total / ((double) n_compared * n_bits),
+		       100.0 * n_same / n_compared, total / n_compared);
+
+	free_matrix(vec, n_vecs * n_long * sizeof *vec);
+	free_matrix(ref, n_ref * n_long * sizeof *ref);
+	free(has_vector);
 }
 
 /* print the help (command line flags documentation) */
@@ -439,7 +1480,8 @@ void print_help(void)
 	puts(
 	"OPTIONS\n"
 	"  -input <file>\n"
-	"    Filename containing the real-value embeddings to binarize\n\n"
+	"    Filename containing the real-value embeddings to binarize (text\n"
+	"    or word2vec binary format)\n\n"
 	"  -output <file>\n"
 	"    Save the binary vectors into <file>\n\n"
 	"  -n-bits <int>\n"
@@ -449,15 +1491,86 @@ void print_help(void)
 	"  -lr-reg <float>\n"
 	"    Learning rate for the regularization; default 0.001\n\n"
 	"  -batch-size <int>\n"
-	"    Number of vectors per batch during training; default 75\n\n"
+	"    Number of vectors per batch during training; default 75\n"
+	);
+
+	puts(
 	"  -epoch <int>\n"
 	"    Number of training epoch; default 5\n"
 	);
 
+	puts(
+	"  -shuffle\n"
+	"    Take the vectors in a different random order at each epoch\n"
+	);
+
+	puts(
+	"  -format <txt|bin>\n"
+	"    Save the binary vectors as text (txt) or with the packed binary\n"
+	"    format (bin); default txt\n\n"
+	"  -save-model <file>\n"
+	"    Save the trained model (W and C) into <file>\n\n"
+	"  -encode <file>\n"
+	"    Do not train: encode the vectors of -input with the model saved\n"
+	"    in <file>, reading them by chunks (constant memory)\n"
+	);
+
+	puts(
+	"  -checkpoint <file>\n"
+	"    Save the training state into <file> during training\n\n"
+	"  -checkpoint-every <int>\n"
+	"    Number of epochs between two checkpoints; default 1\n\n"
+	"  -checkpoint-batches <int>\n"
+	"    Number of batches between two checkpoints; default 0 (never)\n\n"
+	"  -resume\n"
+	"    Continue the training saved in the -checkpoint file (if any)\n"
+	);
+
+	puts(
+	"  -threads <int>\n"
+	"    Number of threads used to parse and encode the vectors;\n"
+	"    default 1\n\n"
+	"  -train-threads <int>\n"
+	"    Number of threads used to train, each one on its own batch (the\n"
+	"    results depend on it); default 1\n\n"
+	"  -hogwild\n"
+	"    Threads update the weights without synchronization\n"
+	);
+
+	puts(
+	"  -cache <file>\n"
+	"    Read the input vectors from the float cache <file>, created from\n"
+	"    -input if it does not exist\n\n"
+	"  -window <int>\n"
+	"    Number of vectors of the cache kept in memory at once during\n"
+	"    training and encoding; default 0 (all of them)\n"
+	);
+
+	puts(
+	"  -storage <string>\n"
+	"    Precision of the input vectors kept in memory: fp32, fp16, bf16\n"
+	"    or int8 (scaled for each vector); default fp32\n\n"
+	"  -compare <file>\n"
+	"    Report how much the binary vectors differ from those of <file>,\n"
+	"    e.g. the output of a run with -storage fp32\n"
+	);
+
+	puts(
+	"  -eval-every <int>\n"
+	"    Encode the words of the evaluation datasets with the current\n"
+	"    model and print their Spearman coefficients after every <int>\n"
+	"    epochs; default 0 (never)\n\n"
+	"  -eval-dir <dir>\n"
+	"    Directory of the evaluation datasets; default datasets/\n"
+	);
+
 	puts(
 	"USAGE\n"
 	"  ./binarize -input vectors.vec -output binary_vectors.vec \\\n"
-	"  -n-bits 256 -lr-rec 0.001 -lr-reg 0.001 -batch-size 75 -epoch 5"
+	"  -n-bits 256 -lr-rec 0.001 -lr-reg 0.001 -batch-size 75 -epoch 5 \\\n"
+	"  -format txt -save-model model.bin\n"
+	"  ./binarize -input new_vectors.vec -output new_binary_vectors.vec \\\n"
+	"  -encode model.bin"
 	);
 }
 
@@ -472,9 +1585,6 @@ int main(int argc, char *argv[])
 	/* real value vectors (matrix stored as a 1D array) */
 	float *real_vec;
 
-	/* binary vectors (matrix stored as a 1D array) */
-	unsigned long *bin_vec;
-
 	/* number of words vectors in input file and their dimension */
 	long n_vecs;
 	int n_dims;
@@ -491,17 +1601,69 @@ int main(int argc, char *argv[])
 	/* number of training epoch */
 	int epoch;
 
+	/* whether binary vectors are saved with the packed binary format */
+	int packed;
+
+	/* number of threads used to parse and encode the vectors, number of
+	 * threads used to train (which changes the batches, so the results),
+	 * whether the latter update the weights without synchronization */
+	int n_threads, train_threads, hogwild;
+
+	/* whether vectors are taken in a different random order each epoch */
+	int shuffle;
+
+	/* float cache of the input vectors (NULL if not used), and number of
+	 * its vectors in memory at once (all of them if 0) */
+	char *cache_filename;
+	long window;
+	struct vec_source src, compact;
+
+	/* precision of the vectors kept in memory (STORAGE_FP32 if they are
+	 * not converted), and output of an other run to compare the binary
+	 * vectors with (NULL if not used) */
+	int storage;
+	char *compare_filename;
+
+	/* evaluation of the model during training */
+	struct evaluation eval;
+
+	/* file where the trained model is saved, model used to encode the input
+	 * vectors without training (empty if not used) */
+	char model_filename[MAXWORDLEN], encode_filename[MAXWORDLEN];
+	struct model model;
+
+	/* checkpoints of the training, and where the training starts */
+	struct checkpoint ckpt;
+	struct train_state state;
+	int resume;
+
 	/* set the default parameters */
 	strcpy(input_filename,  "");
 	strcpy(output_filename, "binary_vectors.vec");
 	words      = NULL;
 	real_vec   = NULL;
-	bin_vec    = NULL;
 	n_bits     = 256;
 	lr_rec     = 0.001f;
 	lr_reg     = 0.001f;
 	batch_size = 75;
 	epoch      = 5;
+	packed     = 0;
+	n_threads  = 1;
+	train_threads = 1;
+	hogwild    = 0;
+	shuffle    = 0;
+	cache_filename = NULL;
+	window         = 0;
+	storage        = STORAGE_FP32;
+	compare_filename = NULL;
+	eval.dirname       = "datasets/";
+	eval.every_epochs  = 0;
+	strcpy(model_filename,  "");
+	strcpy(encode_filename, "");
+	ckpt.filename      = NULL;
+	ckpt.every_epochs  = 1;
+	ckpt.every_batches = 0;
+	resume             = 0;
 
 	/* parse command line arguments */
 	for (++argv, --argc; argc != 0; --argc, ++argv)
@@ -555,6 +1717,96 @@ int main(int argc, char *argv[])
 			epoch = atoi(*++argv);
 			--argc; /* one more argument has been used */
 		}
+		else if (strcmp(*argv, "-format") == 0 && argc > 1)
+		{
+			if (strcmp(*++argv, "bin") == 0)
+				packed = 1;
+			else if (strcmp(*argv, "txt") == 0)
+				packed = 0;
+			else
+				fprintf(stderr, "main: unknown format %s, "
+				        "binary vectors are saved as text.\n",
+				        *argv);
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-threads") == 0 && argc > 1)
+		{
+			n_threads = atoi(*++argv);
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-train-threads") == 0 && argc > 1)
+		{
+			train_threads = atoi(*++argv);
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-cache") == 0 && argc > 1)
+		{
+			cache_filename = *++argv;
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-window") == 0 && argc > 1)
+		{
+			window = atol(*++argv);
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-storage") == 0 && argc > 1)
+		{
+			if ((storage = parse_storage(*++argv)) < 0)
+			{
+				fprintf(stderr, "main: unknown storage %s, "
+				        "vectors are kept as fp32.\n", *argv);
+				storage = STORAGE_FP32;
+			}
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-compare") == 0 && argc > 1)
+		{
+			compare_filename = *++argv;
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-eval-every") == 0 && argc > 1)
+		{
+			eval.every_epochs = atoi(*++argv);
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-eval-dir") == 0 && argc > 1)
+		{
+			eval.dirname = *++argv;
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-save-model") == 0 && argc > 1)
+		{
+			strncpy(model_filename, *++argv, MAXWORDLEN-1);
+			model_filename[MAXWORDLEN-1] = '\0';
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-encode") == 0 && argc > 1)
+		{
+			strncpy(encode_filename, *++argv, MAXWORDLEN-1);
+			encode_filename[MAXWORDLEN-1] = '\0';
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-checkpoint") == 0 && argc > 1)
+		{
+			ckpt.filename = *++argv;
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-checkpoint-every") == 0 && argc > 1)
+		{
+			ckpt.every_epochs = atoi(*++argv);
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-checkpoint-batches") == 0 && argc > 1)
+		{
+			ckpt.every_batches = atol(*++argv);
+			--argc; /* one more argument has been used */
+		}
+		else if (strcmp(*argv, "-resume") == 0)
+			resume = 1;
+		else if (strcmp(*argv, "-shuffle") == 0)
+			shuffle = 1;
+		else if (strcmp(*argv, "-hogwild") == 0)
+			hogwild = 1;
 		else
 		{
 			fprintf(stderr, "main: can't parse argument %s "
@@ -570,13 +1822,98 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	real_vec = load_embedding(input_filename, &words, &n_vecs, &n_dims);
-	bin_vec  = binarize(real_vec, n_vecs, n_dims, n_bits, lr_rec, lr_reg,
-	                    batch_size, epoch);
-	write_binary_vectors(output_filename, words, bin_vec, n_vecs, n_bits);
+	if (n_threads < 1)
+		n_threads = 1;
+	if (train_threads < 1)
+		train_threads = 1;
+
+	/* encode-only mode, the vectors are never all in memory */
+	if (strlen(encode_filename) > 0)
+	{
+		load_model(encode_filename, &model);
+		encode_file(&model, input_filename, output_filename, packed,
+		            n_threads);
+		free(model.W);
+		free(model.C);
+		return 0;
+	}
+
+	/* vectors are either all loaded in memory, or read from the float
+	 * cache (created from the input vectors if it does not exist yet) */
+	if (cache_filename != NULL)
+	{
+		if (access(cache_filename, F_OK) != 0)
+			write_cache(input_filename, cache_filename);
+
+		/* a window must hold at least a batch (of all threads) */
+		if (window > 0 && window < (long) batch_size * train_threads)
+			window = (long) batch_size * train_threads;
+		/* the cache is only read once to be converted, no need to
+		 * have all of its floats in memory */
+		if (storage != STORAGE_FP32 && window == 0)
+			window = ENCODE_CHUNK;
+		open_cache(&src, cache_filename, window);
+	}
+	else
+	{
+		if (window > 0)
+			fprintf(stderr, "main: -window needs -cache <file>, "
+			        "all vectors are loaded in memory.\n");
+		real_vec = load_embedding(input_filename, &words, &n_vecs,
+		                          &n_dims, n_threads);
+		memory_source(&src, real_vec, words, n_vecs, n_dims);
+	}
 
-	destroy_word_list(words, n_vecs);
+	/* keep the vectors in reduced precision, widened to floats by batches
+	 * (of all threads) or by chunks of vectors to encode */
+	if (storage != STORAGE_FP32)
+	{
+		compact_source(&compact, &src, storage,
+		               (long) batch_size * train_threads
+		               > (long) ENCODE_CHUNK * n_threads
+		               ? (long) batch_size * train_threads
+		               : (long) ENCODE_CHUNK * n_threads);
+		close_source(&src);
+		free(real_vec);
+		real_vec = NULL;
+		src = compact;
+	}
+	n_vecs = src.n_vecs;
+	n_dims = src.n_dims;
+
+	init_model(&model, n_dims, n_bits);
+	if (eval.every_epochs > 0)
+		init_evaluation(&eval, &src, n_bits);
+	state.epoch  = 0;
+	state.offset = 0;
+	state.lr_rec = lr_rec;
+	state.lr_reg = lr_reg;
+	if (resume && ckpt.filename == NULL)
+		fprintf(stderr, "main: -resume needs -checkpoint <file>, "
+		        "training from scratch.\n");
+	else if (resume && load_checkpoint(ckpt.filename, &model, &state,
+	                                   n_vecs, batch_size * train_threads))
+		printf("Training resumed at epoch %d, vector %ld.\n",
+		       state.epoch + 1, state.offset);
+	train_model(&model, &src, batch_size, epoch, shuffle, train_threads,
+	            hogwild, &state, &ckpt, &eval);
+	if (strlen(model_filename) > 0)
+		save_model(model_filename, &model);
+	encode_source(&model, &src, output_filename, packed, n_threads);
+	if (compare_filename != NULL)
+		compare_codes(output_filename, compare_filename);
+
+	close_source(&src);
+	if (eval.every_epochs > 0)
+	{
+		free(eval.vec);
+		free(eval.codes);
+		free(eval.has_vector);
+	}
+	if (words != NULL)
+		destroy_word_list(words);
 	free(real_vec); /* `real_vec` is created with a single calloc */
-	free(bin_vec);
+	free(model.W);
+	free(model.C);
 	return 0;
 }
@@ -0,0 +1,1300 @@
+/* Copyright (c) 2019-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of the "Near-lossless Binarization of Word Embeddings"
+ * software (https://github.com/tca19/near-lossless-binarization).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _DEFAULT_SOURCE      /* mmap(), strtof() */
+#include <fcntl.h>           /* open() */
+#include <math.h>
+#include <pthread.h>         /* pthread_create(), pthread_join() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>        /* mmap() */
+#include <sys/stat.h>        /* fstat() */
+#include <unistd.h>          /* close() */
+#include "utils.h"
+
+/* Reading of real-value embeddings: files whose first line is the number of
+ * vectors and their dimension, followed by each word and the values of its
+ * vector. In text files (word2vec/fastText .vec format), each line is a word
+ * followed by its values. In binary files (word2vec .bin format), each word is
+ * followed by a space and its values as n_dims raw floats (and usually by a
+ * line feed). The format is detected from the first vector. */
+
+#define MAXLENFLOAT 64       /* longest value given to strtof() */
+#define MAXTHREADS  256
+#define CACHE_CHUNK 4096     /* number of vectors converted at once */
+
+/* Float cache file, written by write_cache() from a text embedding: a `struct
+ * cache_header`, followed (at offset `vec_offset`, a multiple of BIN_ALIGN) by
+ * the contiguous (n_vecs, n_dims) matrix of floats, then by the word section
+ * (the n_vecs words, each one terminated by a null character). Numbers are in
+ * the byte order of the machine that wrote the file (given by `endian`). */
+#define CACHE_MAGIC   "NLBFLOAT"
+#define CACHE_VERSION 1
+
+struct cache_header
+{
+	char magic[8];          /* CACHE_MAGIC, without the null character */
+	unsigned int version;   /* CACHE_VERSION */
+	unsigned int endian;    /* BIN_ENDIAN */
+	long n_vecs;            /* number of vectors */
+	long n_dims;            /* dimension of each vector */
+	long vec_offset;        /* position of the matrix in file */
+	long words_offset;      /* position of the word section in file */
+	long words_size;        /* size (in bytes) of the word section */
+};
+
+/* exact powers of 10 as doubles (10^22 is the largest one) */
+static const double pow10[] =
+{
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* part of the file parsed by one thread: the lines starting in [start, end) */
+struct text_chunk
+{
+	const char *start, *end;
+	long n_lines;           /* number of (non empty) lines of the chunk */
+	size_t word_bytes;      /* size of their words, null characters too */
+	long first_row;         /* row of the first line in the matrix */
+	long n_vecs;            /* number of rows of the matrix */
+	int n_dims;
+	float *vec;             /* the (n_vecs, n_dims) matrix */
+	char **words;           /* word of each row */
+	char *arena;            /* where the words of the chunk are copied */
+	long bad_line;          /* first line (from 1) with too few values */
+};
+
+/* is_space: return 1 if c separates two values of a line (but not two lines) */
+static int is_space(const char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* parse_float: return the value of the number at `start` (and ending before
+ *              end), store in *next the position after it. The value is
+ *              correctly rounded: numbers whose digits fit in 53 bits and
+ *              with a small exponent are computed with a single (so correctly
+ *              rounded) double operation (Clinger's fast path); the
+ *              rounding to float is right unless the double lies exactly
+ *              halfway between two floats. Other numbers are given to
+ *              strtof(). */
+float parse_float(const char *start, const char *end, const char **next)
+{
+	const char *p = start, *e;
+	char buffer[MAXLENFLOAT], *stop;
+	unsigned long mantissa, bits;
+	int negative, n_digits, exp10, exponent, exp_sign;
+	double d;
+	float f;
+
+	negative = (p < end && *p == '-');
+	if (p < end && (*p == '-' || *p == '+'))
+		++p;
+
+	/* at most 19 digits fit in the mantissa, the following ones are
+	 * dropped (the mantissa is then too large for the fast path) */
+	mantissa = 0;
+	n_digits = 0;
+	exp10 = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; ++p, ++n_digits)
+		if (mantissa < 1000000000000000000UL)
+			mantissa = 10 * mantissa + (*p - '0');
+		else
+			++exp10;
+	if (p < end && *p == '.')
+		for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++n_digits)
+			if (mantissa < 1000000000000000000UL)
+			{
+				mantissa = 10 * mantissa + (*p - '0');
+				--exp10;
+			}
+
+	if (n_digits > 0 && p < end && (*p == 'e' || *p == 'E'))
+	{
+		e = p++;  /* where the number ends if no exponent follows */
+		exp_sign = (p < end && *p == '-') ? -1 : 1;
+		if (p < end && (*p == '-' || *p == '+'))
+			++p;
+		if (p < end && *p >= '0' && *p <= '9')
+		{
+			for (exponent = 0; p < end && *p >= '0' && *p <= '9';
+			     ++p)
+				if (exponent < 10000)
+					exponent = 10 * exponent + (*p - '0');
+			exp10 += exp_sign * exponent;
+		}
+		else
+			p = e;
+	}
+
+	if (n_digits > 0 && mantissa <= (1UL << 53)
+	 && exp10 >= -22 && exp10 <= 22)
+	{
+		d = (exp10 < 0) ? (double) mantissa / pow10[-exp10]
+		                : (double) mantissa * pow10[exp10];
+
+		/* double rounding is only wrong if d is the middle of two
+		 * floats (the 29 bits lost by the conversion are 100...0) */
+		memcpy(&bits, &d, sizeof bits);
+		if ((bits & 0x1FFFFFFFUL) != 0x10000000UL)
+		{
+			f = (float) d;
+			*next = p;
+			return negative ? -f : f;
+		}
+	}
+
+	/* slow path: strtof() needs a null terminated string */
+	for (p = start; p < end && !is_space(*p) && *p != '\n'; ++p)
+		;
+	n_digits = (p - start < MAXLENFLOAT) ? p - start : MAXLENFLOAT - 1;
+	memcpy(buffer, start, n_digits);
+	buffer[n_digits] = '\0';
+	f = strtof(buffer, &stop);
+	*next = start + (stop - buffer);
+	return f;
+}
+
+/* parse_values: parse the n_dims values of the line starting at p (after its
+ *               word, the line ends before `end` or at a line feed) into v.
+ *               Return the position after the line, or NULL if the line has
+ *               less than n_dims values. */
+static const char *parse_values(const char *p, const char *end, float *v,
+	                        const int n_dims)
+{
+	const char *next;
+	int i;
+
+	for (i = 0; i < n_dims; ++i)
+	{
+		while (p < end && is_space(*p))
+			++p;
+		if (p == end || *p == '\n')
+			return NULL;
+		v[i] = parse_float(p, end, &next);
+		if (next == p)  /* not a number */
+			return NULL;
+		p = next;
+	}
+
+	/* ignore the rest of the line */
+	while (p < end && *p != '\n')
+		++p;
+	return (p < end) ? p + 1 : p;
+}
+
+/* next_line: return the start of the first non empty line at or after p (end
+ *            if there is none), store in *word_len the length of its word */
+static const char *next_line(const char *p, const char *end, size_t *word_len)
+{
+	const char *w;
+
+	while (p < end && (is_space(*p) || *p == '\n'))
+		++p;
+	for (w = p; w < end && !is_space(*w) && *w != '\n'; ++w)
+		;
+	*word_len = w - p;
+	return p;
+}
+
+/* is_binary: return 1 if the vector starting at p (first non empty line before
+ *            end) is in the binary format, i.e. its line does not have n_dims
+ *            text values */
+static int is_binary(const char *p, const char *end, const int n_dims)
+{
+	float *v;
+	size_t len;
+	int binary;
+
+	if ((p = next_line(p, end, &len)) == end)
+		return 0;
+	if ((v = malloc(n_dims * sizeof *v)) == NULL)
+	{
+		fprintf(stderr, "is_binary: can't allocate memory\n");
+		exit(1);
+	}
+	binary = parse_values(p + len, end, v, n_dims) == NULL;
+	free(v);
+	return binary;
+}
+
+/* next_record: return the start of the word of the first vector at or after p
+ *              of a binary embedding (end if there is none), store in
+ *              *word_len the length of its word. Its values start after the
+ *              space following the word. Exit if the file ends before them. */
+static const char *next_record(const char *p, const char *end,
+	                       size_t *word_len, const int n_dims)
+{
+	const char *w;
+
+	while (p < end && (is_space(*p) || *p == '\n'))
+		++p;
+	if (p == end)
+		return end;
+	for (w = p; w < end && *w != ' '; ++w)
+		;
+	if ((size_t) (end - w) < 1 + n_dims * sizeof(float))
+	{
+		fprintf(stderr, "next_record: the binary vector of %.*s is "
+		        "incomplete\n", (int) (w - p), p);
+		exit(1);
+	}
+	*word_len = w - p;
+	return p;
+}
+
+/* load_binary: load the n_vecs vectors of the binary embedding starting at
+ *              `data` into `words` and a new matrix; return the matrix. A first
+ *              pass gets the size of the words, so that they are stored in a
+ *              single block of memory like with text embeddings. Values are
+ *              copied as they are: there is nothing to parse. */
+static float *load_binary(const char *data, const char *end,
+	                  const char *filename, char ***words,
+	                  const long n_vecs, const int n_dims)
+{
+	const char *p;
+	char *arena;
+	float *vec;
+	size_t len, word_bytes, vec_bytes;
+	long row;
+
+	vec_bytes = n_dims * sizeof *vec;
+	for (p = next_record(data, end, &len, n_dims), row = 0, word_bytes = 0;
+	     p < end && row < n_vecs;
+	     p = next_record(p + len + 1 + vec_bytes, end, &len, n_dims), ++row)
+		word_bytes += len + 1;
+	if (row < n_vecs)
+	{
+		fprintf(stderr, "load_embedding: EOF reached. Only %ld "
+		        "vectors loaded (first line of %s indicates "
+		        "there are %ld vectors).\n", row, filename, n_vecs);
+		exit(1);
+	}
+
+	if ((*words = calloc(n_vecs + 1, sizeof **words)) == NULL
+	 || (arena = malloc(word_bytes + 1)) == NULL
+	 || (vec = malloc(n_vecs * vec_bytes + 1)) == NULL)
+	{
+		fprintf(stderr, "load_embedding: can't allocate memory for "
+		        "embedding\n");
+		exit(1);
+	}
+	(*words)[0] = arena;  /* even if there is no vector */
+
+	for (p = next_record(data, end, &len, n_dims), row = 0; row < n_vecs;
+	     p = next_record(p + len + 1 + vec_bytes, end, &len, n_dims), ++row)
+	{
+		memcpy(arena, p, len);
+		arena[len] = '\0';
+		(*words)[row] = arena;
+		arena += len + 1;
+		memcpy(vec + row * n_dims, p + len + 1, vec_bytes);
+	}
+	return vec;
+}
+
+/* count_lines: count the lines of the chunk and the size of their words. Used
+ *              as a thread routine, so it takes and returns a void pointer. */
+static void *count_lines(void *arg)
+{
+	struct text_chunk *c = arg;
+	const char *p;
+	size_t len;
+
+	c->n_lines = 0;
+	c->word_bytes = 0;
+	for (p = next_line(c->start, c->end, &len); p < c->end;
+	     p = next_line(p, c->end, &len))
+	{
+		++c->n_lines;
+		c->word_bytes += len + 1;
+		while (p < c->end && *p++ != '\n')
+			;
+	}
+	return NULL;
+}
+
+/* parse_lines: parse the lines of the chunk into their rows of the matrix, copy
+ *              their words into the arena of the chunk. Used as a thread
+ *              routine, so it takes and returns a void pointer. */
+static void *parse_lines(void *arg)
+{
+	struct text_chunk *c = arg;
+	const char *p;
+	char *arena;
+	long row;
+	size_t len;
+
+	arena = c->arena;
+	c->bad_line = 0;
+	for (p = next_line(c->start, c->end, &len), row = c->first_row;
+	     p < c->end && row < c->n_vecs;
+	     p = next_line(p, c->end, &len), ++row)
+	{
+		memcpy(arena, p, len);
+		arena[len] = '\0';
+		c->words[row] = arena;
+		arena += len + 1;
+
+		if ((p = parse_values(p + len, c->end, c->vec + row * c->n_dims,
+		                      c->n_dims)) == NULL)
+		{
+			c->bad_line = row + 2; /* +1 for the first line */
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* run_chunks: run `routine` on each of the n chunks, each one in its thread */
+static void run_chunks(void *(*routine)(void*), struct text_chunk *chunks,
+	               const int n)
+{
+	pthread_t threads[MAXTHREADS];
+	int i;
+
+	if (n == 1)
+	{
+		routine(chunks);
+		return;
+	}
+	for (i = 0; i < n; ++i)
+		if (pthread_create(threads + i, NULL, routine, chunks + i) != 0)
+		{
+			fprintf(stderr, "run_chunks: can't create thread\n");
+			exit(1);
+		}
+	for (i = 0; i < n; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+/* read_embedding_header: read the number of vectors and their dimension from
+ *                        the first line of `s` (of length len); return the
+ *                        position after this line */
+static const char *read_embedding_header(const char *s, const size_t len,
+	                                 const char *filename, long *n_vecs,
+	                                 int *n_dims)
+{
+	char line[MAXLENFLOAT];
+	const char *p;
+
+	for (p = s; p < s + len && *p != '\n'; ++p)
+		;
+	if (p - s >= MAXLENFLOAT)
+		p = s + MAXLENFLOAT - 1;
+	memcpy(line, s, p - s);
+	line[p - s] = '\0';
+
+	/* n_vecs and n_dims are pointers, no need of & */
+	if (sscanf(line, "%ld %d", n_vecs, n_dims) != 2 || *n_vecs < 0
+	 || *n_dims <= 0)
+	{
+		fprintf(stderr, "load_embedding: first line of %s should "
+		        "contain the number of words in file and the dimension "
+		        "of vectors\n", filename);
+		exit(1);
+	}
+	while (p < s + len && *p != '\n')
+		++p;
+	return (p < s + len) ? p + 1 : p;
+}
+
+/* load_embedding: load the list of words and vectors from `filename` with
+ *                 n_threads threads; return the embedding. The file is mapped
+ *                 in memory. Binary vectors are directly copied, text ones are
+ *                 split into n_threads chunks of whole lines.
+ *                 A first pass counts the lines of each chunk (so each thread
+ *                 knows the row of its first line) and the size of their
+ *                 words, then each thread parses its lines directly into their
+ *                 rows. All words are stored in a single block of memory,
+ *                 starting at (*words)[0]. */
+float *load_embedding(const char *filename, char ***words, long *n_vecs,
+	              int *n_dims, int n_threads)
+{
+	struct text_chunk chunks[MAXTHREADS];
+	struct stat st;
+	const char *map, *data, *end, *p;
+	char *arena;
+	float *vec;                /* to store the word vectors */
+	long row;
+	size_t word_bytes;
+	int fd, i;
+
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "load_embedding: can't open %s\n", filename);
+		exit(1);
+	}
+	if (st.st_size == 0
+	 || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED)
+	{
+		fprintf(stderr, "load_embedding: can't read %s\n", filename);
+		exit(1);
+	}
+	close(fd);
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+	end = map + st.st_size;
+	data = read_embedding_header(map, st.st_size, filename, n_vecs, n_dims);
+	if (is_binary(data, end, *n_dims))
+	{
+		vec = load_binary(data, end, filename, words, *n_vecs, *n_dims);
+		munmap((void *) map, st.st_size);
+		return vec;
+	}
+
+	/* chunks end at a line feed, tiny files are read by one thread */
+	if (n_threads > MAXTHREADS)
+		n_threads = MAXTHREADS;
+	if (n_threads > (end - data) / 4096 + 1)
+		n_threads = (end - data) / 4096 + 1;
+	for (i = 0, p = data; i < n_threads; ++i)
+	{
+		chunks[i].start = p;
+		p = data + (end - data) * (i + 1) / n_threads;
+		while (p < end && p > data && p[-1] != '\n')
+			++p;
+		if (p < chunks[i].start)
+			p = chunks[i].start;
+		chunks[i].end = p;
+	}
+	chunks[n_threads - 1].end = end;
+	run_chunks(count_lines, chunks, n_threads);
+
+	for (i = 0, row = 0, word_bytes = 0; i < n_threads; ++i)
+	{
+		chunks[i].first_row = row;
+		row += chunks[i].n_lines;
+		word_bytes += chunks[i].word_bytes;
+	}
+	if (row < *n_vecs)
+	{
+		fprintf(stderr, "load_embedding: EOF reached. Only %ld "
+		        "vectors loaded (first line of %s indicates "
+		        "there are %ld vectors).\n", row, filename, *n_vecs);
+		exit(1);
+	}
+
+	/* `words` is supposed to be an array of strings (so char**) but we are
+	 * passing it by reference to directly modify the variable passed as a
+	 * parameter, so one more level of indirection (that's why it is
+	 * char***). `*word` is the content of the passed pointer (the actual
+	 * array of strings) */
+	if ((*words = calloc(*n_vecs + 1, sizeof **words)) == NULL
+	 || (arena = malloc(word_bytes + 1)) == NULL
+	 || (vec = calloc((size_t) *n_vecs * *n_dims, sizeof *vec)) == NULL)
+	{
+		fprintf(stderr, "load_embedding: can't allocate memory for "
+		        "embedding\n");
+		exit(1);
+	}
+	(*words)[0] = arena;  /* even if there is no vector */
+
+	for (i = 0; i < n_threads; ++i)
+	{
+		chunks[i].n_vecs = *n_vecs;
+		chunks[i].n_dims = *n_dims;
+		chunks[i].vec    = vec;
+		chunks[i].words  = *words;
+		chunks[i].arena  = arena;
+		arena += chunks[i].word_bytes;
+	}
+	run_chunks(parse_lines, chunks, n_threads);
+	for (i = 0; i < n_threads; ++i)
+		if (chunks[i].bad_line > 0)
+		{
+			fprintf(stderr, "load_embedding: line %ld of %s has "
+			        "less than %d values\n", chunks[i].bad_line,
+			        filename, *n_dims);
+			exit(1);
+		}
+
+	munmap((void *) map, st.st_size);
+	return vec;
+}
+
+/* destroy_word_list: free the memory used to store the list of words of
+ *                    load_embedding() */
+void destroy_word_list(char **words)
+{
+	/* all words are in a single block, starting with the first one */
+	free(words[0]);
+	free(words);
+}
+
+/* read_line: read the next line of `fp` (without its line feed) into *line,
+ *            a buffer of *size bytes which grows with the lines; return its
+ *            length, or -1 if the end of `fp` is reached */
+static long read_line(FILE *fp, char **line, size_t *size)
+{
+	size_t len;
+	int c;
+
+	for (len = 0; (c = getc(fp)) != EOF && c != '\n'; (*line)[len++] = c)
+		if (len + 1 >= *size)
+		{
+			*size = (*size == 0) ? 4096 : 2 * *size;
+			if ((*line = realloc(*line, *size)) == NULL)
+			{
+				fprintf(stderr, "read_line: can't allocate "
+				        "memory\n");
+				exit(1);
+			}
+		}
+	return (len == 0 && c == EOF) ? -1 : (long) len;
+}
+
+/* read_embedding_size: read the first line of `fp` (number of vectors and
+ *                      their dimension); return 1 if the vectors are in the
+ *                      binary format, 0 if they are text. The first vector is
+ *                      read to know it, then `fp` goes back before it. */
+int read_embedding_size(FILE *fp, const char *filename, long *n_vecs,
+	                int *n_dims)
+{
+	char *line;
+	size_t size;
+	long pos, len;
+	int c, binary;
+
+	/* n_vecs and n_dims are pointers, no need of & */
+	if (fscanf(fp, "%ld %d", n_vecs, n_dims) != 2 || *n_dims <= 0)
+	{
+		fprintf(stderr, "read_embedding_size: first line of %s should "
+		        "contain the number of words in file and the dimension "
+		        "of vectors\n", filename);
+		exit(1);
+	}
+	while ((c = getc(fp)) != EOF && c != '\n')
+		;
+
+	line = NULL;
+	size = 0;
+	pos  = ftell(fp);
+	len  = read_line(fp, &line, &size);
+	binary = len > 0 && is_binary(line, line + len, *n_dims);
+	free(line);
+	if (fseek(fp, pos, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "read_embedding_size: can't read %s\n",
+		        filename);
+		exit(1);
+	}
+	return binary;
+}
+
+/* read_binary_vectors: read the next n binary vectors of `fp` like
+ *                      read_vectors() */
+static long read_binary_vectors(FILE *fp, char **words, float *vec, long n,
+	                        int n_dims)
+{
+	static char *word = NULL;
+	static size_t size = 0;
+	size_t len;
+	long index;
+	int c;
+
+	for (index = 0; index < n; ++index)
+	{
+		while ((c = getc(fp)) != EOF && (is_space(c) || c == '\n'))
+			;
+		if (c == EOF)
+			break;
+
+		/* the word ends at the space before its values */
+		for (len = 0; c != EOF && c != ' '; c = getc(fp))
+		{
+			if (len + 1 >= size)
+			{
+				size = (size == 0) ? 256 : 2 * size;
+				if ((word = realloc(word, size)) == NULL)
+				{
+					fprintf(stderr, "read_vectors: can't "
+					        "allocate memory\n");
+					exit(1);
+				}
+			}
+			word[len++] = c;
+		}
+		if ((words[index] = malloc(len + 1)) == NULL)
+		{
+			fprintf(stderr, "read_vectors: can't allocate "
+			        "memory\n");
+			exit(1);
+		}
+		memcpy(words[index], word, len);
+		words[index][len] = '\0';
+		if (fread(vec + index * n_dims, sizeof *vec, n_dims, fp)
+		    != (size_t) n_dims)
+		{
+			fprintf(stderr, "read_vectors: the binary vector of %s"
+			        " is incomplete\n", words[index]);
+			exit(1);
+		}
+	}
+	return index;
+}
+
+/* read_vectors: read the next n vectors of `fp` (after its first line, binary
+ *               ones if `binary`) into `words` (each one allocated with
+ *               malloc) and the (n, n_dims) matrix `vec`; return the number of
+ *               vectors read, less than n only if the end of `fp` is reached.
+ *               Text values are parsed like with load_embedding(), but the
+ *               file is read line by line. */
+long read_vectors(FILE *fp, char **words, float *vec, long n, int n_dims,
+	          int binary)
+{
+	static char *line = NULL;
+	static size_t size = 0;
+	const char *p;
+	size_t word_len;
+	long index, len;
+
+	if (binary)
+		return read_binary_vectors(fp, words, vec, n, n_dims);
+
+	for (index = 0; index < n && (len = read_line(fp, &line, &size)) >= 0; )
+	{
+		/* skip empty lines */
+		if ((p = next_line(line, line + len, &word_len)) == line + len)
+			continue;
+		if ((words[index] = malloc(word_len + 1)) == NULL)
+		{
+			fprintf(stderr, "read_vectors: can't allocate "
+			        "memory\n");
+			exit(1);
+		}
+		memcpy(words[index], p, word_len);
+		words[index][word_len] = '\0';
+		if (parse_values(p + word_len, line + len, vec + index * n_dims,
+		                 n_dims) == NULL)
+		{
+			fprintf(stderr, "read_vectors: the line of %s has less "
+			        "than %d values\n", words[index], n_dims);
+			exit(1);
+		}
+		++index;
+	}
+	return index;
+}
+
+/* write_cache: convert the embedding `input_filename` (text or binary) into
+ *              the float cache `cache_filename` (format described at the top
+ *              of this file). The input is read by chunks of CACHE_CHUNK
+ *              vectors, so the memory used does not depend on the number of
+ *              vectors. The cache is written into a temporary file, then
+ *              renamed: an interrupted conversion never leaves an incomplete
+ *              cache. */
+void write_cache(const char *input_filename, const char *cache_filename)
+{
+	static const char padding[BIN_ALIGN];
+	struct cache_header h;
+	FILE *fi, *fo;
+	char *tmp, *words[CACHE_CHUNK];
+	float *vec;
+	long n_vecs, done, n, i, words_pos;
+	int n_dims, binary;
+
+	if ((fi = fopen(input_filename, "rb")) == NULL)
+	{
+		fprintf(stderr, "write_cache: can't open %s\n", input_filename);
+		exit(1);
+	}
+	binary = read_embedding_size(fi, input_filename, &n_vecs, &n_dims);
+	if ((tmp = malloc(strlen(cache_filename) + 5)) == NULL
+	 || (vec = malloc(CACHE_CHUNK * n_dims * sizeof *vec)) == NULL)
+	{
+		fprintf(stderr, "write_cache: can't allocate memory\n");
+		exit(1);
+	}
+	strcpy(tmp, cache_filename);
+	strcat(tmp, ".tmp");
+
+	/* the word section directly follows the matrix, its size is only known
+	 * once all words are written */
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, CACHE_MAGIC, sizeof h.magic);
+	h.version      = CACHE_VERSION;
+	h.endian       = BIN_ENDIAN;
+	h.n_vecs       = n_vecs;
+	h.n_dims       = n_dims;
+	h.vec_offset   = (sizeof h + BIN_ALIGN - 1) / BIN_ALIGN * BIN_ALIGN;
+	h.words_offset = h.vec_offset + n_vecs * n_dims * sizeof *vec;
+	words_pos      = h.words_offset;
+	if ((fo = fopen(tmp, "wb")) == NULL
+	 || fwrite(&h, sizeof h, 1, fo) != 1
+	 || fwrite(padding, h.vec_offset - sizeof h, 1, fo) != 1)
+	{
+		fprintf(stderr, "write_cache: can't write %s\n", tmp);
+		exit(1);
+	}
+
+	for (done = 0; done < n_vecs; done += n)
+	{
+		n = (n_vecs - done < CACHE_CHUNK) ? n_vecs - done : CACHE_CHUNK;
+		if (read_vectors(fi, words, vec, n, n_dims, binary) != n)
+		{
+			fprintf(stderr, "write_cache: EOF reached. Only %ld "
+			        "vectors read (first line of %s indicates "
+			        "there are %ld vectors).\n", done,
+			        input_filename, n_vecs);
+			exit(1);
+		}
+
+		/* vectors go at their row in the matrix, words at the end of
+		 * the word section */
+		if (fseek(fo, h.vec_offset + done * n_dims * sizeof *vec,
+		          SEEK_SET) != 0
+		 || fwrite(vec, n_dims * sizeof *vec, n, fo) != (size_t) n
+		 || fseek(fo, words_pos, SEEK_SET) != 0)
+		{
+			fprintf(stderr, "write_cache: can't write %s\n", tmp);
+			exit(1);
+		}
+		for (i = 0; i < n; ++i)
+		{
+			if (fwrite(words[i], strlen(words[i]) + 1, 1, fo) != 1)
+			{
+				fprintf(stderr, "write_cache: can't write %s\n",
+				        tmp);
+				exit(1);
+			}
+			words_pos += strlen(words[i]) + 1;
+			free(words[i]);
+		}
+	}
+
+	h.words_size = words_pos - h.words_offset;
+	if (fseek(fo, 0, SEEK_SET) != 0 || fwrite(&h, sizeof h, 1, fo) != 1
+	 || fclose(fo) != 0 || rename(tmp, cache_filename) != 0)
+	{
+		fprintf(stderr, "write_cache: can't write %s\n", tmp);
+		exit(1);
+	}
+	fclose(fi);
+	free(tmp);
+	free(vec);
+}
+
+/* read_at: read `size` bytes at position `offset` of `fd` into `buffer` */
+static void read_at(const int fd, void *buffer, size_t size, off_t offset)
+{
+	ssize_t n;
+
+	for (; size > 0; size -= n, offset += n, buffer = (char *) buffer + n)
+		if ((n = pread(fd, buffer, size, offset)) <= 0)
+		{
+			fprintf(stderr, "read_at: can't read the float "
+			        "cache\n");
+			exit(1);
+		}
+}
+
+/* memory_source: make `src` give the rows of the (n_vecs, n_dims) matrix `vec`
+ *                (already in memory), whose words are `words` */
+void memory_source(struct vec_source *src, const float *vec, char **words,
+	           const long n_vecs, const int n_dims)
+{
+	memset(src, 0, sizeof *src);
+	src->n_vecs = n_vecs;
+	src->n_dims = n_dims;
+	src->vec    = vec;
+	src->words  = words;
+	src->fd     = -1;
+}
+
+/* map_cache: make `src` give the rows of the whole float cache, whose file is
+ *            `fd` and header `h`. The file is mapped in memory: the matrix is
+ *            used as it is, and only the array of pointers to the words is
+ *            built, so nothing is copied. Pages are read from the file when
+ *            they are first used (or from the page cache, if the file was
+ *            read recently). */
+static void map_cache(struct vec_source *src, const struct cache_header *h,
+	              const char *filename)
+{
+	struct stat st;
+	char *map, *p, *end;
+	long i;
+
+	if (fstat(src->fd, &st) != 0
+	 || st.st_size < h->words_offset + h->words_size
+	 || h->words_offset < h->vec_offset
+	                      + h->n_vecs * h->n_dims * (long) sizeof(float)
+	 || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, src->fd, 0))
+	    == MAP_FAILED)
+	{
+		fprintf(stderr, "open_cache: can't read %s\n", filename);
+		exit(1);
+	}
+	close(src->fd);
+	src->fd       = -1;
+	src->map      = map;
+	src->map_size = st.st_size;
+	madvise(map, st.st_size, MADV_WILLNEED);
+	src->vec = (const float *) (map + h->vec_offset);
+
+	if ((src->word_ptrs = malloc((h->n_vecs + 1) * sizeof *src->word_ptrs))
+	    == NULL)
+	{
+		fprintf(stderr, "open_cache: can't allocate memory\n");
+		exit(1);
+	}
+	p   = map + h->words_offset;
+	end = p + h->words_size;
+	for (i = 0; i < h->n_vecs && p < end; ++i)
+	{
+		src->word_ptrs[i] = p;
+		while (p < end && *p != '\0')
+			++p;
+		++p;
+	}
+	if (i < h->n_vecs || p != end)
+	{
+		fprintf(stderr, "open_cache: the words of %s are damaged\n",
+		        filename);
+		exit(1);
+	}
+	src->words = src->word_ptrs;
+}
+
+/* open_cache: make `src` give the rows of the float cache `filename`. Only a
+ *             window of `window` consecutive rows is in memory at once: when a
+ *             row outside of it is asked, the window is read again from the
+ *             file, starting at this row. If window <= 0, all rows are used:
+ *             the file is mapped in memory instead. */
+void open_cache(struct vec_source *src, const char *filename, long window)
+{
+	struct cache_header h;
+
+	memset(src, 0, sizeof *src);
+	if ((src->fd = open(filename, O_RDONLY)) < 0)
+	{
+		fprintf(stderr, "open_cache: can't open %s\n", filename);
+		exit(1);
+	}
+	if (pread(src->fd, &h, sizeof h, 0) != sizeof h
+	 || memcmp(h.magic, CACHE_MAGIC, sizeof h.magic) != 0
+	 || h.endian != BIN_ENDIAN || h.version > CACHE_VERSION
+	 || h.n_vecs < 0 || h.n_dims <= 0)
+	{
+		fprintf(stderr, "open_cache: %s is not a float cache written on"
+		        " this machine\n", filename);
+		exit(1);
+	}
+
+	src->n_vecs       = h.n_vecs;
+	src->n_dims       = h.n_dims;
+	if (window <= 0)
+	{
+		map_cache(src, &h, filename);
+		return;
+	}
+
+	src->vec_offset   = h.vec_offset;
+	src->words_offset = h.words_offset;
+	src->window_size  = (window > h.n_vecs) ? h.n_vecs : window;
+	src->window_first = 0;
+	src->window_n     = 0;
+	if ((src->window = malloc((src->window_size + 1) * src->n_dims
+	                          * sizeof *src->window)) == NULL
+	 || (src->words_fp = fopen(filename, "rb")) == NULL
+	 || fseek(src->words_fp, h.words_offset, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "open_cache: can't read %s\n", filename);
+		exit(1);
+	}
+}
+
+/* parse_storage: return the STORAGE_ constant named `name` (fp32, fp16, bf16
+ *                or int8), -1 if there is none */
+int parse_storage(const char *name)
+{
+	static const char *names[] = { "fp32", "fp16", "bf16", "int8" };
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	return -1;
+}
+
+/* float_bits: return the bits of f */
+static unsigned int float_bits(const float f)
+{
+	unsigned int u;
+
+	memcpy(&u, &f, sizeof u);
+	return u;
+}
+
+/* bits_float: return the float whose bits are u */
+static float bits_float(const unsigned int u)
+{
+	float f;
+
+	memcpy(&f, &u, sizeof f);
+	return f;
+}
+
+/* to_half: return the half precision float nearest to f (ties to even) */
+static unsigned short to_half(const float f)
+{
+	unsigned int u, sign, mantissa, shift;
+	int exponent;
+
+	u = float_bits(f);
+	sign = (u >> 16) & 0x8000;
+	exponent = (int) ((u >> 23) & 0xff) - 127 + 15;
+	mantissa = u & 0x7fffff;
+
+	if (((u >> 23) & 0xff) == 0xff)   /* infinity or NaN */
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	if (exponent >= 31)               /* too large: infinity */
+		return sign | 0x7c00;
+	if (exponent <= 0)                /* subnormal half (or 0) */
+	{
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;     /* implicit leading 1 */
+		shift = 14 - exponent;
+		u = mantissa >> shift;
+		mantissa &= (1U << shift) - 1;
+		if (mantissa > (1U << (shift - 1))
+		 || (mantissa == (1U << (shift - 1)) && (u & 1)))
+			++u;
+		return sign | u;
+	}
+
+	/* normal half: round the 13 dropped bits (a carry goes into the
+	 * exponent, which is right, up to infinity) */
+	u = ((unsigned int) exponent << 10) | (mantissa >> 13);
+	mantissa &= 0x1fff;
+	if (mantissa > 0x1000 || (mantissa == 0x1000 && (u & 1)))
+		++u;
+	return sign | u;
+}
+
+/* from_half: return the value of the half precision float h */
+static float from_half(const unsigned short h)
+{
+	unsigned int sign, exponent, mantissa;
+
+	sign = (unsigned int) (h & 0x8000) << 16;
+	exponent = (h >> 10) & 0x1f;
+	mantissa = h & 0x3ff;
+
+	if (exponent == 0x1f)             /* infinity or NaN */
+		return bits_float(sign | 0x7f800000 | (mantissa << 13));
+	if (exponent == 0)                /* subnormal (or 0): m * 2^-24 */
+		return (sign ? -1.0f : 1.0f) * mantissa * (1.0f / 16777216);
+	return bits_float(sign | ((exponent - 15 + 127) << 23)
+	                  | (mantissa << 13));
+}
+
+/* to_bf16: return the bfloat16 nearest to f (ties to even) */
+static unsigned short to_bf16(const float f)
+{
+	unsigned int u;
+
+	u = float_bits(f);
+	if ((u & 0x7fffffff) > 0x7f800000)  /* NaN stays a NaN */
+		return (u >> 16) | 0x40;
+	return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
+
+/* half_table: value of each of the 65536 half precision floats, so widening is
+ *             a single lookup */
+static float half_table[65536];
+
+/* narrow_rows: store the n rows `vec` as rows first, ..., first+n-1 of the
+ *              reduced precision matrix of `src` */
+static void narrow_rows(struct vec_source *src, const float *vec,
+	                const long first, const long n)
+{
+	unsigned short *h;
+	signed char *q;
+	float max, scale;
+	long i, size;
+	int j;
+
+	size = n * src->n_dims;
+	switch (src->storage)
+	{
+	case STORAGE_FP16:
+		h = (unsigned short *) src->data + first * src->n_dims;
+		for (i = 0; i < size; ++i)
+			h[i] = to_half(vec[i]);
+		break;
+	case STORAGE_BF16:
+		h = (unsigned short *) src->data + first * src->n_dims;
+		for (i = 0; i < size; ++i)
+			h[i] = to_bf16(vec[i]);
+		break;
+	case STORAGE_INT8:
+		q = (signed char *) src->data + first * src->n_dims;
+		for (i = 0; i < n; ++i, vec += src->n_dims, q += src->n_dims)
+		{
+			/* the largest value of the row is 127 * scale */
+			for (max = 0, j = 0; j < src->n_dims; ++j)
+				if (fabs(vec[j]) > max)
+					max = fabs(vec[j]);
+			scale = max / 127;
+			src->scale[first + i] = scale;
+			for (j = 0; j < src->n_dims; ++j)
+				q[j] = (scale == 0) ? 0
+				       : (signed char) floor(vec[j] / scale
+				                             + 0.5);
+		}
+		break;
+	}
+}
+
+/* widen_rows: store into `vec` the rows first, ..., first+n-1 of the reduced
+ *             precision matrix of `src`, as floats */
+static void widen_rows(const struct vec_source *src, const long first,
+	               const long n, float *vec)
+{
+	const unsigned short *h;
+	const signed char *q;
+	float scale;
+	long i, size;
+	int j;
+
+	size = n * src->n_dims;
+	switch (src->storage)
+	{
+	case STORAGE_FP16:
+		h = (const unsigned short *) src->data + first * src->n_dims;
+		for (i = 0; i < size; ++i)
+			vec[i] = half_table[h[i]];
+		break;
+	case STORAGE_BF16:
+		h = (const unsigned short *) src->data + first * src->n_dims;
+		for (i = 0; i < size; ++i)
+			vec[i] = bits_float((unsigned int) h[i] << 16);
+		break;
+	case STORAGE_INT8:
+		q = (const signed char *) src->data + first * src->n_dims;
+		for (i = 0; i < n; ++i, vec += src->n_dims, q += src->n_dims)
+			for (scale = src->scale[first + i], j = 0;
+			     j < src->n_dims; ++j)
+				vec[j] = q[j] * scale;
+		break;
+	}
+}
+
+/* compact_source: make `dst` give the rows of `src`, kept in memory in the
+ *                 reduced precision `storage` (STORAGE_FP16, STORAGE_BF16 or
+ *                 STORAGE_INT8), widened to floats when asked, at most
+ *                 `max_rows` at once. Rows of `src` are read in order by
+ *                 chunks, so if `src` is a float cache, the whole matrix is
+ *                 never in memory as floats. `dst` takes the words of `src`,
+ *                 which can then be closed. */
+void compact_source(struct vec_source *dst, struct vec_source *src,
+	            const int storage, const long max_rows)
+{
+	long first, n, chunk, i;
+	size_t size;
+
+	memset(dst, 0, sizeof *dst);
+	dst->n_vecs      = src->n_vecs;
+	dst->n_dims      = src->n_dims;
+	dst->storage     = storage;
+	dst->fd          = -1;
+	dst->window_size = max_rows;
+	size = (storage == STORAGE_INT8) ? sizeof(signed char)
+	                                 : sizeof(unsigned short);
+	if ((dst->data = malloc(src->n_vecs * src->n_dims * size + 1)) == NULL
+	 || (dst->window = malloc((max_rows + 1) * src->n_dims
+	                          * sizeof *dst->window)) == NULL
+	 || (storage == STORAGE_INT8
+	  && (dst->scale = malloc((src->n_vecs + 1) * sizeof *dst->scale))
+	     == NULL))
+	{
+		fprintf(stderr, "compact_source: can't allocate memory\n");
+		exit(1);
+	}
+	if (storage == STORAGE_FP16)
+		for (i = 0; i < 65536; ++i)
+			half_table[i] = from_half(i);
+
+	chunk = (src->vec == NULL) ? src->window_size : CACHE_CHUNK;
+	for (first = 0; first < src->n_vecs; first += n)
+	{
+		n = (src->n_vecs - first < chunk) ? src->n_vecs - first : chunk;
+		narrow_rows(dst, get_rows(src, first, n), first, n);
+	}
+
+	/* the words stay where they are: in memory or in the cache */
+	dst->words    = src->words;
+	dst->words_fp = src->words_fp;
+	dst->words_offset = src->words_offset;
+	src->words_fp = NULL;
+	if (src->map != NULL)
+	{
+		dst->map       = src->map;
+		dst->map_size  = src->map_size;
+		dst->word_ptrs = src->word_ptrs;
+		src->map       = NULL;
+		src->word_ptrs = NULL;
+	}
+}
+
+/* close_source: release the memory and the files used by `src` (not the matrix
+ *               and the words given to memory_source()) */
+void close_source(struct vec_source *src)
+{
+	if (src->fd >= 0)
+		close(src->fd);
+	if (src->words_fp != NULL)
+		fclose(src->words_fp);
+	free(src->window);
+	free(src->word_ptrs);
+	free(src->word_buf);
+	free(src->data);
+	free(src->scale);
+	if (src->map != NULL)
+		munmap(src->map, src->map_size);
+}
+
+/* get_rows: return the (n, n_dims) matrix of rows first, ..., first+n-1 of
+ *           `src` (n must not be larger than its window). The returned rows
+ *           are valid until the next call. A new window starts at a multiple
+ *           of the window size if it can hold the rows (so rows of the same
+ *           block of window_size rows, asked in any order, are read from the
+ *           file only once), otherwise at `first`. Rows kept in reduced
+ *           precision are widened to floats into the window. */
+const float *get_rows(struct vec_source *src, const long first, const long n)
+{
+	long start, size;
+
+	if (src->vec != NULL)
+		return src->vec + first * src->n_dims;
+	if (src->data != NULL && n > src->window_size)
+	{
+		fprintf(stderr, "get_rows: %ld rows asked, only %ld can be "
+		        "widened at once\n", n, src->window_size);
+		exit(1);
+	}
+	if (src->data != NULL)
+	{
+		widen_rows(src, first, n, src->window);
+		return src->window;
+	}
+
+	if (first < src->window_first
+	 || first + n > src->window_first + src->window_n)
+	{
+		if (n > src->window_size)
+		{
+			fprintf(stderr, "get_rows: %ld rows asked, the window "
+			        "only has %ld rows\n", n, src->window_size);
+			exit(1);
+		}
+		start = first - first % src->window_size;
+		if (first + n > start + src->window_size)
+			start = first;
+		size = (src->n_vecs - start < src->window_size)
+		       ? src->n_vecs - start : src->window_size;
+		read_at(src->fd, src->window, size * src->n_dims
+		        * sizeof *src->window, src->vec_offset + start
+		        * src->n_dims * sizeof *src->window);
+		src->window_first = start;
+		src->window_n     = size;
+	}
+	return src->window + (first - src->window_first) * src->n_dims;
+}
+
+/* get_words: return the words of rows first, ..., first+n-1 of `src`. If they
+ *            are in a cache, the word section is read sequentially: rows must
+ *            be asked in order, and the returned words are valid until the
+ *            next call. */
+char **get_words(struct vec_source *src, const long first, const long n)
+{
+	long i;
+	size_t len;
+	int c;
+
+	if (src->words != NULL)
+		return src->words + first;
+
+	/* asking the first word again reads the word section again */
+	if (first == 0 && src->next_word != 0)
+	{
+		if (fseek(src->words_fp, src->words_offset, SEEK_SET) != 0)
+		{
+			fprintf(stderr, "get_words: can't read the cache\n");
+			exit(1);
+		}
+		src->next_word = 0;
+	}
+	if (first != src->next_word)
+	{
+		fprintf(stderr, "get_words: words of the cache must be read in "
+		        "order\n");
+		exit(1);
+	}
+	if (n > src->max_words)
+	{
+		src->max_words = n;
+		src->word_ptrs = realloc(src->word_ptrs,
+		                         n * sizeof *src->word_ptrs);
+		if (src->word_ptrs == NULL)
+		{
+			fprintf(stderr, "get_words: can't allocate memory\n");
+			exit(1);
+		}
+	}
+
+	/* read the n words into the buffer, then find where each one starts */
+	for (i = 0, len = 0; i < n; )
+	{
+		if (len == src->word_buf_size)
+		{
+			src->word_buf_size = (len == 0) ? 4096 : 2 * len;
+			src->word_buf = realloc(src->word_buf,
+			                        src->word_buf_size);
+			if (src->word_buf == NULL)
+			{
+				fprintf(stderr, "get_words: can't allocate "
+				        "memory\n");
+				exit(1);
+			}
+		}
+		if ((c = getc(src->words_fp)) == EOF)
+		{
+			fprintf(stderr, "get_words: the word section of the "
+			        "cache is truncated\n");
+			exit(1);
+		}
+		if ((src->word_buf[len++] = c) == '\0')
+			++i;
+	}
+	for (i = 0, len = 0; i < n; ++i)
+	{
+		src->word_ptrs[i] = src->word_buf + len;
+		len += strlen(src->word_ptrs[i]) + 1;
+	}
+	src->next_word = first + n;
+	return src->word_ptrs;
+}
@@ -19,15 +19,27 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _DEFAULT_SOURCE      /* mmap(), madvise(), syscall() */
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h> /* strcpy, strcmp, strcat */
+#include <string.h>          /* strcpy, strcmp, strcat, memcmp */
+#include <sys/mman.h>        /* mmap(), madvise() */
+#include <sys/syscall.h>     /* SYS_mbind */
+#include <unistd.h>          /* syscall() */
 #include "utils.h"
 
 #define MAXLINES   5000 /* maximum number of pairs in an evaluation dataset */
 #define MAXLENPATH 256  /* maximum length to access an evaluation dataset */
 #define MAXLENWORD 256  /* maximum length of a word in an embedding file */
+#define HUGEPAGE   (2 * 1024 * 1024) /* size of a transparent huge page */
+#define MPOL_INTERLEAVE 3            /* memory policy for mbind() */
+
+/* If set (i.e. not zero), the pages of the matrix allocated by alloc_matrix()
+ * are interleaved across all NUMA nodes, so that threads running on any node
+ * get the same memory bandwidth. Not static because programs (like
+ * topk_binary.c) set it from their command line arguments. */
+int numa_interleave = 0;
 
 /* create_vocab: read each file in dirname to create vocab of unique words */
 void create_vocab(const char *dirname)
@@ -77,6 +89,200 @@ void create_vocab(const char *dirname)
 	closedir(dp);
 }
 
+/* vector_index: return the row of the embedding matrix where the vector of
+ *               `word` has to be stored, or -1 if the vector should not be
+ *               loaded (see load_vectors() for `load_all_vectors`). */
+long vector_index(const char *word, const int load_all_vectors)
+{
+	long index;
+
+	/* Do not load all vectors, only those in hashtab (-1 if word not in
+	 * hashtab, so the vector is skipped). */
+	if (!load_all_vectors)
+		return get_index(word);
+
+	/* Else, add it into the hashtab with `add_word()` (a single lookup,
+	 * which also gives the index of the word if it is already there). The
+	 * word is also added into the index->word array with the second
+	 * parameter set to 1. When a word is added into the hash table, its
+	 * index is set to n_words (variable from hashtab.c), the current number
+	 * of words already in hashtab, which is then increased. This index is
+	 * used to know which row of the embedding matrix should be filled with
+	 * values from the embedding file. A word vector that has already been
+	 * loaded (smaller index) is skipped. */
+	index = n_words;
+	return (add_word(word, 1) == index) ? index : -1;
+}
+
+/* mapped_size: return the number of bytes mapped for a block of `size` bytes
+ *              from alloc_matrix(): a multiple of the huge page size,
+ *              otherwise the kernel can't back the end of the block with a
+ *              huge page (and at least one page, even for an empty block) */
+static size_t mapped_size(size_t size)
+{
+	size = (size + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE;
+	return (size == 0) ? HUGEPAGE : size;
+}
+
+/* alloc_matrix: return a zeroed memory block of `size` bytes, aligned on a
+ *               page boundary (so on a cache line). The block is backed by
+ *               transparent huge pages when possible, so that scanning the
+ *               whole matrix requires less TLB misses. */
+void *alloc_matrix(size_t size)
+{
+	void *ptr;
+
+	size = mapped_size(size);
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+	{
+		fprintf(stderr, "alloc_matrix: can't allocate %lu bytes\n",
+		        (unsigned long) size);
+		exit(1);
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+#ifdef SYS_mbind
+	/* nodes not available to this process are ignored by the kernel, so
+	 * ask for all of them. mbind() is called through syscall() to not
+	 * depend on libnuma. */
+	if (numa_interleave)
+	{
+		unsigned long nodemask = ~0UL;
+
+		if (syscall(SYS_mbind, ptr, size, MPOL_INTERLEAVE, &nodemask,
+		            sizeof nodemask * 8, 0) != 0)
+			fprintf(stderr, "alloc_matrix: can't interleave memory "
+			        "across NUMA nodes\n");
+	}
+#endif
+
+	return ptr;
+}
+
+/* free_matrix: release a memory block of `size` bytes from alloc_matrix() */
+void free_matrix(void *ptr, size_t size)
+{
+	size = mapped_size(size);
+	munmap(ptr, size);
+}
+
+/* shrink_matrix: release the end of a memory block of `size` bytes from
+ *                alloc_matrix(), so that only its first `new_size` bytes are
+ *                left (and can be released by free_matrix(ptr, new_size)) */
+static void shrink_matrix(void *ptr, size_t size, size_t new_size)
+{
+	size = mapped_size(size);
+	new_size = mapped_size(new_size);
+	if (new_size < size)
+		munmap((char *) ptr + new_size, size - new_size);
+}
+
+/* load_text_vectors: read the vectors of the text file `fp` (first line already
+ *                    read) into the rows of `vec`. See load_vectors(). */
+void load_text_vectors(FILE *fp, unsigned long *vec, char *has_vector,
+	               const int n_long, const int load_all_vectors)
+{
+	int i;
+	long index;
+	char word[MAXLENWORD];     /* to read the word of each line in file */
+	unsigned long tmp;         /* to skip the values of unused vectors */
+
+	while (fscanf(fp, "%s", word) > 0)
+	{
+		/* Word vector should not be loaded, skip it. To skip it, read
+		 * all its vector values into the garbage variable `tmp` then go
+		 * to next one. */
+		if ((index = vector_index(word, load_all_vectors)) < 0)
+		{
+			for (i = 0; i < n_long; ++i)
+				fscanf(fp, "%lu", &tmp);
+			continue;
+		}
+
+		for (i = 0; i < n_long; ++i)
+			fscanf(fp, "%lu", vec + index * n_long + i);
+		has_vector[index] = 1;
+	}
+}
+
+/* load_packed_vectors: read the vectors of the packed binary file `fp` (header
+ *                      already read) into the rows of `vec`. See
+ *                      load_vectors(). */
+void load_packed_vectors(FILE *fp, const struct bin_header *header,
+	                 unsigned long *vec, char *has_vector, const int n_long,
+	                 const int load_all_vectors)
+{
+	long i, index;
+	size_t row_size;
+	char *word_section, *word; /* all the words of file, one after another */
+
+	if ((word_section = malloc(header->words_size)) == NULL)
+	{
+		fprintf(stderr, "load_packed_vectors: can't allocate memory "
+		        "for words\n");
+		exit(1);
+	}
+
+	/* When all vectors are loaded, the rows of the file are the rows of
+	 * the matrix, so the whole code matrix is read with a single fread().
+	 * Otherwise, only the few needed rows are read (once the words are
+	 * known). */
+	row_size = n_long * sizeof *vec;
+	if (fseek(fp, header->words_offset, SEEK_SET) != 0
+	 || fread(word_section, 1, header->words_size, fp)
+	    != (size_t) header->words_size
+	 || word_section[header->words_size - 1] != '\0'
+	 || (load_all_vectors
+	  && (fseek(fp, header->codes_offset, SEEK_SET) != 0
+	   || fread(vec, row_size, header->n_vecs, fp)
+	      != (size_t) header->n_vecs)))
+	{
+		fprintf(stderr, "load_packed_vectors: file is truncated\n");
+		exit(1);
+	}
+
+	/* words are stored one after another, each one with its null character
+	 * so the next word starts right after it */
+	for (i = 0, word = word_section; i < header->n_vecs;
+	     ++i, word += strlen(word) + 1)
+	{
+		if (word >= word_section + header->words_size)
+		{
+			fprintf(stderr, "load_packed_vectors: word section has "
+			        "less than %ld words\n", header->n_vecs);
+			exit(1);
+		}
+		if ((index = vector_index(word, load_all_vectors)) < 0)
+			continue;
+
+		/* Rows of duplicated words are skipped, so the following rows
+		 * have to be moved up. Row `index` is never after row `i`. */
+		if (load_all_vectors)
+		{
+			if (index != i)
+				memcpy(vec + index * n_long, vec + i * n_long,
+				       row_size);
+		}
+		else if (fseek(fp, header->codes_offset + i * row_size,
+		               SEEK_SET) != 0
+		      || fread(vec + index * n_long, row_size, 1, fp) != 1)
+		{
+			fprintf(stderr, "load_packed_vectors: file is "
+			        "truncated\n");
+			exit(1);
+		}
+		has_vector[index] = 1;
+	}
+
+	/* hashtab made its own copy of each word */
+	free(word_section);
+}
+
 /* load_vectors: read the vector file `name`. If `load_all_vectors` is set
  *               (i.e. not zero), read all word vectors from the file and
  *               return the binary embedding matrix (also add each word into
@@ -85,101 +291,116 @@ void create_vocab(const char *dirname)
  *               populated with create_vocab()). In this case, no words are
  *               added to hashtab. Each binary word vector is loaded as an
  *               array of `long`, so to represent a vector of 256 bits it
- *               requires an array of 4 `long`. */
-unsigned long **load_vectors(const char *name, long *n_vecs, int *n_bits,
-	                     int *n_long, const int load_all_vectors)
+ *               requires an array of 4 `long`. The matrix is returned as a
+ *               single contiguous block of (n_vecs, n_long) `long`, where
+ *               row i is the vector of the word of index i in hashtab, and
+ *               `n_vecs` is set to the number of rows (the block is released
+ *               with free_matrix() of n_vecs * n_long `long`). If
+ *               `has_vector` is not NULL, it is set to an array telling for
+ *               each row whether its vector has been found in the file. The
+ *               file can either be a text file or a packed binary file (see
+ *               utils.h), the format is detected from the first bytes of the
+ *               file. */
+unsigned long *load_vectors(const char *name, long *n_vecs, int *n_bits,
+	                    int *n_long, char **has_vector,
+	                    const int load_all_vectors)
 {
-	int i;
-	long index;
 	FILE *fp;                  /* to open vector file */
-	char word[MAXLENWORD];     /* to read the word of each line in file */
-	unsigned long **vec, tmp;  /* to store the binary embeddings values */
+	unsigned long *vec;        /* to store the binary embeddings values */
+	char *found;               /* whether each row has been loaded */
+	long n_rows;
+	struct bin_header header;  /* header of packed binary files */
+	int packed;
 
-	if ((fp = fopen(name, "r")) == NULL)
+	if ((fp = fopen(name, "rb")) == NULL)
 	{
 		fprintf(stderr, "load_vectors: can't open %s\n", name);
 		exit(1);
 	}
 
-	if (fscanf(fp, "%ld %d", n_vecs, n_bits) <= 0)
+	/* packed binary files start with BIN_MAGIC, text files start with the
+	 * number of vectors */
+	packed = fread(&header, sizeof header, 1, fp) == 1
+	      && memcmp(header.magic, BIN_MAGIC, sizeof header.magic) == 0;
+
+	if (packed)
+	{
+		if (header.endian != BIN_ENDIAN)
+		{
+			fprintf(stderr, "load_vectors: %s has been written on a"
+			        " machine with a different byte order\n", name);
+			exit(1);
+		}
+		if (header.version > BIN_VERSION)
+		{
+			fprintf(stderr, "load_vectors: %s has format version "
+			        "%u, only version %d is supported\n", name,
+			        header.version, BIN_VERSION);
+			exit(1);
+		}
+		*n_vecs = header.n_vecs;
+		*n_bits = header.n_bits;
+	}
+	else if (fseek(fp, 0, SEEK_SET) != 0
+	      || fscanf(fp, "%ld %d", n_vecs, n_bits) <= 0)
 	{
 		fprintf(stderr, "load_vectors: can't read number of bits\n");
 		exit(1);
 	}
 
-	/* Only allocate memory to save the pointers to vectors. The memory
-	 * needed to load binary values is done individually for each vector a
-	 * bit further (because in the case of the similarity_binary program,
-	 * only the words from the evaluation datasets are loaded, so no need
-	 * to allocate a lot of memory that we are not going to use). */
+	/* choose the Hamming distance kernel and the scan routine for this
+	 * number of bits now, before any similarity is computed between the
+	 * loaded vectors */
+	init_hamming(*n_bits / (sizeof(long) * 8));
+	init_scan(*n_bits);
+
+	/* When all vectors are loaded, there is one row per vector of the file.
+	 * Otherwise (similarity_binary program), there is one row per word of
+	 * the evaluation datasets, so no need to allocate a lot of memory that
+	 * we are not going to use. */
 	*n_long = *n_bits / (sizeof(long) * 8);
-	if ((vec = calloc(*n_vecs, sizeof *vec)) == NULL)
-		return NULL;
+	n_rows = load_all_vectors ? *n_vecs : n_words;
+	vec = alloc_matrix(n_rows * *n_long * sizeof *vec);
+	if ((found = calloc(n_rows + 1, sizeof *found)) == NULL)
+	{
+		fprintf(stderr, "load_vectors: can't allocate memory\n");
+		exit(1);
+	}
 
 	/* Allocate memory for the index->word array (declared in hashtab.c).
 	 * It will contain the same number of words as the number of vectors in
 	 * the embedding file. */
-	if ((words = calloc(*n_vecs, sizeof *words)) == NULL)
+	if (load_all_vectors && (words = calloc(*n_vecs, sizeof *words)) == NULL)
 		fprintf(stderr, "load_vectors: no memory for index<=>word\n");
+	if (load_all_vectors)
+		reserve_words(*n_vecs);
 
-	while (fscanf(fp, "%s", word) > 0)
-	{
-		index = get_index(word);
+	if (packed)
+		load_packed_vectors(fp, &header, vec, found, *n_long,
+		                    load_all_vectors);
+	else
+		load_text_vectors(fp, vec, found, *n_long, load_all_vectors);
 
-		if (load_all_vectors)
-		{
-			/* Word vector has already been loaded, skip it. To
-			 * skip it, read all its vector values into the garbage
-			 * variable `tmp` then go to next one. */
-			if (index > 0)
-			{
-				for (i = 0; i < *n_long; ++i)
-					fscanf(fp, "%lu", &tmp);
-				continue;
-			}
-
-			/* Else, add it into the hashtab with `add_word()`. The
-			 * word is also added into the index->word array with
-			 * the second parameter set to 1 (done in the function
-			 * `add_word()`). */
-			else
-			{
-				/* When a word is added into the hash table
-				 * with `add_word()`, its index is set to
-				 * n_words (variable from hashtab.c). It is the
-				 * current number of words already in hashtab.
-				 * It is automatically increased within the
-				 * function `add_word()`. This index is then
-				 * used to know which row of the embedding
-				 * matrix should be filled with values from the
-				 * embedding file. */
-				index = n_words;
-				add_word(word, 1);
-			}
-		}
-		else /* Do not load all vectors, only those in hashtab. */
-		{
-			if (index == -1) /* word not in hashtab; skip it */
-			{
-				for (i = 0; i < *n_long; ++i)
-					fscanf(fp, "%lu", &tmp);
-				continue;
-			}
-		}
-
-		/* Allocate memory to read vector values and load them. */
-		if ((vec[index] = calloc(*n_long, sizeof **vec)) == NULL)
-			continue;
-		for (i = 0; i < *n_long; ++i)
-			fscanf(fp, "%lu", vec[index]+i);
-	}
+	/* duplicated words of the file only have one row, the unused rows at
+	 * the end of the matrix are released so that callers can free it with
+	 * the returned number of rows */
+	*n_vecs = load_all_vectors ? n_words : n_rows;
+	shrink_matrix(vec, n_rows * *n_long * sizeof *vec,
+	              *n_vecs * *n_long * sizeof *vec);
+	if (has_vector != NULL)
+		*has_vector = found;
+	else
+		free(found);
 
 	fclose(fp);
 	return vec;
 }
 
-/* evaluate: compute Spearman coefficient for each file in dirname */
-void evaluate(const char *dirname, void **vec, int n_dim,
+/* evaluate: compute Spearman coefficient for each file in dirname. `vec` is
+ *           the (n_words, n_long) matrix of vectors, `has_vector` tells which
+ *           of its rows have a vector. */
+void evaluate(const char *dirname, const unsigned long *vec,
+	      const char *has_vector, int n_long,
 	      float (*sim)(const void*, const void*, const int))
 {
 	DIR *dp;
@@ -231,11 +452,13 @@ void evaluate(const char *dirname, void **vec, int n_dim,
 			index1 = get_index(word1);
 			index2 = get_index(word2);
 
-			if (vec[index1] == NULL || vec[index2] == NULL)
+			if (index1 < 0 || !has_vector[index1]
+			 || index2 < 0 || !has_vector[index2])
 				continue;
 
 			simfile[found] = val;
-			simvec[found] = sim(vec[index1], vec[index2], n_dim);
+			simvec[found] = sim(vec + index1 * n_long,
+			                    vec + index2 * n_long, n_long);
 			++found;
 		}
 
@@ -245,20 +468,17 @@ void evaluate(const char *dirname, void **vec, int n_dim,
 		fclose(fp);
 	}
 	closedir(dp);
+	free(simfile);
+	free(simvec);
 }
 
 /* binary_sim: return the Sokal-Michener binary similarity (#common / #bits) */
 float binary_sim(const void *v1, const void *v2, const int n_long)
 {
-	int n, i;
-	static unsigned long *ar1, *ar2;
-
-	ar1 = (unsigned long *) v1;
-	ar2 = (unsigned long *) v2;
-
-	/* need the ~ because *ar1 ^ *ar2 sets the bit to 0 if same bit */
-	for (n = 0, i = 0; i++ < n_long; ++ar1, ++ar2)
-		n += __builtin_popcountl(~*ar1 ^ *ar2);
+	int n_bits;
 
-	return n / (float) (sizeof(long) * 8 * n_long);
+	/* the number of common bits is the number of bits minus the number of
+	 * different bits (the Hamming distance) */
+	n_bits = sizeof(long) * 8 * n_long;
+	return (n_bits - hamming(v1, v2, n_long)) / (float) n_bits;
 }
@@ -0,0 +1,364 @@
+/* Copyright (c) 2019-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of the "Near-lossless Binarization of Word Embeddings"
+ * software (https://github.com/tca19/near-lossless-binarization).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+/* Function used to compute the Hamming distance between two binary vectors.
+ * It points to the fastest kernel the CPU supports once init_hamming() has
+ * been called; until then, it is the portable scalar kernel. Not static
+ * because used by other files (like file_process.c). */
+int (*hamming)(const unsigned long*, const unsigned long*, const int) =
+	hamming_scalar;
+
+/* Name of the kernel `hamming` points to, to report which one is used. */
+const char *hamming_name = "scalar";
+
+/* Function used to compute the Hamming distances between one query vector and
+ * consecutive rows of a matrix. It points to a routine specialized for the
+ * number of bits of the vectors once init_scan() has been called; until then,
+ * it is the generic routine. Not static because used by other files (like
+ * topk_binary.c). */
+void (*scan_rows)(const unsigned long*, const unsigned long*, const long,
+                  const int, int*) = scan_generic;
+
+/* hamming_scalar: return the number of different bits between the arrays of
+ *                 `long` a and b (portable version) */
+int hamming_scalar(const unsigned long *a, const unsigned long *b,
+	           const int n_long)
+{
+	int i, n;
+
+	for (n = 0, i = 0; i < n_long; ++i)
+		n += __builtin_popcountl(a[i] ^ b[i]);
+	return n;
+}
+
+/* scan_generic: store into dist[i] the Hamming distance between `query` and
+ *               the i-th vector of `rows`, for each of the `n_rows` vectors
+ *               (each one with `n_long` long) */
+void scan_generic(const unsigned long *query, const unsigned long *rows,
+	          const long n_rows, const int n_long, int *dist)
+{
+	long i;
+
+	for (i = 0; i < n_rows; ++i, rows += n_long)
+		dist[i] = hamming(query, rows, n_long);
+}
+
+/* DEFINE_SCAN: define the function `name`, same as scan_generic() but for
+ *              vectors of exactly N long. Since N is a constant, the compiler
+ *              fully unrolls the inner loop and keeps the N words of the query
+ *              in registers for the whole scan. `attr` is prepended to the
+ *              definition to compile it for a specific instruction set. */
+#define DEFINE_SCAN(name, N, attr)                                          \
+attr void name(const unsigned long *query, const unsigned long *rows,      \
+               const long n_rows, const int n_long, int *dist)             \
+{                                                                           \
+	unsigned long q[N];                                                 \
+	long i;                                                             \
+	int j, d;                                                           \
+                                                                            \
+	(void) n_long; /* always N */                                       \
+	for (j = 0; j < N; ++j)                                             \
+		q[j] = query[j];                                            \
+	for (i = 0; i < n_rows; ++i, rows += N)                             \
+	{                                                                   \
+		for (d = 0, j = 0; j < N; ++j)                              \
+			d += __builtin_popcountl(q[j] ^ rows[j]);           \
+		dist[i] = d;                                                \
+	}                                                                   \
+}
+
+#define PORTABLE /* no target attribute */
+DEFINE_SCAN(scan_64,  1, PORTABLE)
+DEFINE_SCAN(scan_128, 2, PORTABLE)
+DEFINE_SCAN(scan_256, 4, PORTABLE)
+DEFINE_SCAN(scan_512, 8, PORTABLE)
+
+#ifdef X86_KERNELS
+#define POPCNT __attribute__((target("popcnt")))
+DEFINE_SCAN(scan_64_popcnt,  1, POPCNT)
+DEFINE_SCAN(scan_128_popcnt, 2, POPCNT)
+DEFINE_SCAN(scan_256_popcnt, 4, POPCNT)
+DEFINE_SCAN(scan_512_popcnt, 8, POPCNT)
+
+/* DEFINE_SCAN_AVX512: same as DEFINE_SCAN, with the AVX-512 VPOPCNTDQ
+ *                     instruction, for N = 4 or 8. A register holds 8/N
+ *                     consecutive rows, XORed with as many copies of the
+ *                     query; the counts of its lanes are then added row by
+ *                     row. The last rows are read with a masked load. */
+#define DEFINE_SCAN_AVX512(name, N)                                         \
+__attribute__((target("avx512f,avx512vpopcntdq")))                          \
+void name(const unsigned long *query, const unsigned long *rows,           \
+          const long n_rows, const int n_long, int *dist)                  \
+{                                                                           \
+	unsigned long copies[8];                                            \
+	__m512i q, v;                                                       \
+	__mmask8 mask;                                                      \
+	long i;                                                             \
+	int j;                                                              \
+                                                                            \
+	(void) n_long; /* always N */                                       \
+	for (j = 0; j < 8; ++j)                                             \
+		copies[j] = query[j % N];                                   \
+	q = _mm512_loadu_si512((const void *) copies);                      \
+	for (i = 0; i + 8/N <= n_rows; i += 8/N, rows += 8)                 \
+	{                                                                   \
+		v = _mm512_loadu_si512((const void *) rows);                \
+		v = _mm512_popcnt_epi64(_mm512_xor_si512(q, v));            \
+		for (j = 0; j < 8/N; ++j)                                   \
+			dist[i+j] = (int) _mm512_mask_reduce_add_epi64(     \
+			        (__mmask8) (((1u << N) - 1) << (j*N)), v);  \
+	}                                                                   \
+	if (i < n_rows)                                                     \
+	{                                                                   \
+		mask = (__mmask8) ((1u << ((n_rows - i) * N)) - 1);         \
+		v = _mm512_maskz_loadu_epi64(mask, (const void *) rows);    \
+		v = _mm512_popcnt_epi64(_mm512_xor_si512(q, v));            \
+		for (j = 0; j < n_rows - i; ++j)                            \
+			dist[i+j] = (int) _mm512_mask_reduce_add_epi64(     \
+			        (__mmask8) (((1u << N) - 1) << (j*N)), v);  \
+	}                                                                   \
+}
+
+DEFINE_SCAN_AVX512(scan_256_avx512, 4)
+DEFINE_SCAN_AVX512(scan_512_avx512, 8)
+
+/* hamming_popcnt: same as hamming_scalar(), but compiled to use the POPCNT
+ *                 instruction (SSE4.2 generation CPUs) */
+__attribute__((target("popcnt")))
+int hamming_popcnt(const unsigned long *a, const unsigned long *b,
+	           const int n_long)
+{
+	int i, n;
+
+	for (n = 0, i = 0; i < n_long; ++i)
+		n += __builtin_popcountl(a[i] ^ b[i]);
+	return n;
+}
+
+/* popcount256: return the number of bits set in each 64-bit lane of v. Each
+ *              nibble is counted with a lookup table (vpshufb), then the byte
+ *              counts are summed per lane with vpsadbw. */
+__attribute__((target("avx2")))
+static __m256i popcount256(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i lo, hi;
+
+	lo = _mm256_and_si256(v, low_mask);
+	hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+	v  = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+	                     _mm256_shuffle_epi8(lookup, hi));
+	return _mm256_sad_epu8(v, _mm256_setzero_si256());
+}
+
+/* carry-save adder: add the bits of a, b and c; h gets the carries and l the
+ * sums. Used to count the bits of 16 vectors with only one popcount. */
+#define CSA(h, l, a, b, c)                                          \
+	do {                                                        \
+		__m256i u_ = _mm256_xor_si256(a, b);                \
+		h = _mm256_or_si256(_mm256_and_si256(a, b),         \
+		                    _mm256_and_si256(u_, c));       \
+		l = _mm256_xor_si256(u_, c);                        \
+	} while (0)
+
+/* load the i-th group of 256 bits of a XOR b */
+#define XOR256(i)                                                          \
+	_mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + 4*(i))), \
+	                 _mm256_loadu_si256((const __m256i *) (b + 4*(i))))
+
+/* hamming_avx2: same as hamming_scalar(), with AVX2 instructions. Blocks of
+ *               1024 bits go through the Harley-Seal carry-save adder
+ *               network, the remaining groups of 256 bits are counted
+ *               directly, then the last `long` one at a time. */
+__attribute__((target("avx2,popcnt")))
+int hamming_avx2(const unsigned long *a, const unsigned long *b,
+	         const int n_long)
+{
+	__m256i total, ones, twos, fours, eights, sixteens;
+	__m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+	unsigned long lanes[4];
+	int i, n;
+
+	total = ones = twos = fours = eights = _mm256_setzero_si256();
+	for (i = 0; i + 16 <= n_long / 4; i += 16)
+	{
+		CSA(twos_a, ones, ones, XOR256(i), XOR256(i+1));
+		CSA(twos_b, ones, ones, XOR256(i+2), XOR256(i+3));
+		CSA(fours_a, twos, twos, twos_a, twos_b);
+		CSA(twos_a, ones, ones, XOR256(i+4), XOR256(i+5));
+		CSA(twos_b, ones, ones, XOR256(i+6), XOR256(i+7));
+		CSA(fours_b, twos, twos, twos_a, twos_b);
+		CSA(eights_a, fours, fours, fours_a, fours_b);
+		CSA(twos_a, ones, ones, XOR256(i+8), XOR256(i+9));
+		CSA(twos_b, ones, ones, XOR256(i+10), XOR256(i+11));
+		CSA(fours_a, twos, twos, twos_a, twos_b);
+		CSA(twos_a, ones, ones, XOR256(i+12), XOR256(i+13));
+		CSA(twos_b, ones, ones, XOR256(i+14), XOR256(i+15));
+		CSA(fours_b, twos, twos, twos_a, twos_b);
+		CSA(eights_b, fours, fours, fours_a, fours_b);
+		CSA(sixteens, eights, eights, eights_a, eights_b);
+		total = _mm256_add_epi64(total, popcount256(sixteens));
+	}
+
+	/* each bit of `eights` (resp. fours, twos, ones) is worth 8 (resp.
+	 * 4, 2, 1) bits of the input */
+	total = _mm256_slli_epi64(total, 4);
+	total = _mm256_add_epi64(total,
+	            _mm256_slli_epi64(popcount256(eights), 3));
+	total = _mm256_add_epi64(total,
+	            _mm256_slli_epi64(popcount256(fours), 2));
+	total = _mm256_add_epi64(total,
+	            _mm256_slli_epi64(popcount256(twos), 1));
+	total = _mm256_add_epi64(total, popcount256(ones));
+
+	for (; i < n_long / 4; ++i)
+		total = _mm256_add_epi64(total, popcount256(XOR256(i)));
+
+	_mm256_storeu_si256((__m256i *) lanes, total);
+	n = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (i *= 4; i < n_long; ++i)
+		n += __builtin_popcountl(a[i] ^ b[i]);
+	return n;
+}
+
+/* hamming_avx512: same as hamming_scalar(), with the AVX-512 VPOPCNTDQ
+ *                 instruction counting the bits of 8 `long` at once. The last
+ *                 group is read with a masked load. */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+int hamming_avx512(const unsigned long *a, const unsigned long *b,
+	           const int n_long)
+{
+	__m512i total, va, vb;
+	__mmask8 mask;
+	int i;
+
+	total = _mm512_setzero_si512();
+	for (i = 0; i + 8 <= n_long; i += 8)
+	{
+		va = _mm512_loadu_si512((const void *) (a + i));
+		vb = _mm512_loadu_si512((const void *) (b + i));
+		total = _mm512_add_epi64(total,
+		            _mm512_popcnt_epi64(_mm512_xor_si512(va, vb)));
+	}
+
+	if (i < n_long)
+	{
+		mask = (__mmask8) ((1u << (n_long - i)) - 1);
+		va = _mm512_maskz_loadu_epi64(mask, (const void *) (a + i));
+		vb = _mm512_maskz_loadu_epi64(mask, (const void *) (b + i));
+		total = _mm512_add_epi64(total,
+		            _mm512_popcnt_epi64(_mm512_xor_si512(va, vb)));
+	}
+
+	return (int) _mm512_reduce_add_epi64(total);
+}
+#endif
+
+/* Number of `long` of a block of the Harley-Seal network of hamming_avx2().
+ * Shorter vectors only go through its direct count of 256 bits, which is
+ * slower than POPCNT on each `long` (14 vs 5 GB/s at 256 bits, 27 vs 20 GB/s
+ * at 1024 bits, 24 vs 32 GB/s at 4096 bits). */
+#define HARLEY_SEAL_LONGS 64
+
+/* init_hamming: make `hamming` point to the fastest kernel supported by the
+ *               CPU (detected with CPUID) for vectors of `n_long` long. Only
+ *               needs to be called once. */
+void init_hamming(const int n_long)
+{
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")
+	 && __builtin_cpu_supports("avx512vpopcntdq"))
+	{
+		hamming = hamming_avx512;
+		hamming_name = "avx512";
+	}
+	else if (__builtin_cpu_supports("avx2") && n_long >= HARLEY_SEAL_LONGS)
+	{
+		hamming = hamming_avx2;
+		hamming_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("popcnt"))
+	{
+		hamming = hamming_popcnt;
+		hamming_name = "popcnt";
+	}
+	else
+#endif
+	{
+		hamming = hamming_scalar;
+		hamming_name = "scalar";
+	}
+	(void) n_long; /* only needed to choose between x86 kernels */
+}
+
+/* init_scan: make `scan_rows` point to the routine specialized for vectors of
+ *            `n_bits` bits (64, 128, 256 or 512), with AVX-512 VPOPCNTDQ (256
+ *            and 512 bits) or POPCNT if the CPU supports it. Other sizes use
+ *            scan_generic(), which calls the `hamming` kernel chosen by
+ *            init_hamming(). */
+void init_scan(const int n_bits)
+{
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")
+	 && __builtin_cpu_supports("avx512vpopcntdq"))
+	{
+		switch (n_bits)
+		{
+		case 256: scan_rows = scan_256_avx512; return;
+		case 512: scan_rows = scan_512_avx512; return;
+		}
+	}
+	if (__builtin_cpu_supports("popcnt"))
+	{
+		switch (n_bits)
+		{
+		case 64:  scan_rows = scan_64_popcnt;  return;
+		case 128: scan_rows = scan_128_popcnt; return;
+		case 256: scan_rows = scan_256_popcnt; return;
+		case 512: scan_rows = scan_512_popcnt; return;
+		}
+	}
+#endif
+
+	switch (n_bits)
+	{
+	case 64:  scan_rows = scan_64;      break;
+	case 128: scan_rows = scan_128;     break;
+	case 256: scan_rows = scan_256;     break;
+	case 512: scan_rows = scan_512;     break;
+	default:  scan_rows = scan_generic; break;
+	}
+}
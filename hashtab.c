@@ -19,26 +19,40 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "utils.h"
 
-#define HASHSIZE   1000000
+#define INITSIZE   1024       /* initial number of slots of hashtab */
+#define ARENACHUNK (1 << 20)  /* size of the blocks of the string arena */
 
-struct nlist
+struct slot
 {
-	struct nlist *next; /* next element in linked list */
-	char *word;
-	long index;
+	char *word;             /* NULL if the slot is empty */
+	unsigned int hash;      /* hash value of word, to compare it faster */
+	unsigned int index;
 };
 
-/* Hash table composed of linked lists. This variable is made static because it
- * should only be accessed from functions defined in this file. Only the
- * functions get_index() and add_word() have access to it (either to find the
- * index of a word or to add a new word into the hash table). */
-static struct nlist *hashtab[HASHSIZE];
+/* Hash table with open addressing (linear probing). Its number of slots is a
+ * power of 2, doubled when it becomes more than half full. These variables are
+ * made static because they should only be accessed from functions defined in
+ * this file. Only the functions get_index() and add_word() have access to them
+ * (either to find the index of a word or to add a new word into the hash
+ * table). */
+static struct slot *hashtab = NULL;
+static unsigned long size = 0;
+
+/* Words of hashtab are stored one after another in large blocks of memory (an
+ * arena) instead of having their own allocation. A block is never moved, so
+ * the words keep their address when new ones are added. Each block starts with
+ * a pointer to the previous one, so that all of them can be released. */
+static char *last_block = NULL; /* most recent block */
+static char *arena = NULL;      /* where words start in the current block */
+static size_t arena_used = 0;   /* bytes of the current block already used */
+static size_t arena_size = 0;   /* size of the current block */
 
 /* Counter to know the current number of words in the hash table. Also used as
  * the index for new words (e.g. if there are 17 words in the hash table, the
@@ -50,45 +64,130 @@ long n_words = 0;
  * not declared as static because used by other files (like topk_binary.c). */
 char **words = NULL;
 
-/* hash: form hash value for string s */
-unsigned int hash(const char *s)
+/* hash: form hash value for string s (32 bits FNV-1a) */
+static unsigned int hash(const char *s)
 {
 	unsigned int hashval;
 
-	for (hashval = 0; *s != '\0'; ++s)
-		hashval = *s + 31 * hashval;
-	return hashval % HASHSIZE;
+	for (hashval = 2166136261U; *s != '\0'; ++s)
+		hashval = (hashval ^ (unsigned char) *s) * 16777619U;
+	return hashval;
+}
+
+/* find_slot: return the slot of string s (whose hash value is hashval), or the
+ *            empty slot where it should be added if it is not in hashtab */
+static struct slot *find_slot(const char *s, const unsigned int hashval)
+{
+	unsigned long i;
+
+	for (i = hashval & (size - 1); hashtab[i].word != NULL;
+	     i = (i + 1) & (size - 1))
+		if (hashtab[i].hash == hashval && strcmp(hashtab[i].word, s) == 0)
+			break;
+	return hashtab + i;
+}
+
+/* resize: move the words of hashtab into a table of new_size slots (a power
+ *         of 2 larger than twice the number of words) */
+static void resize(const unsigned long new_size)
+{
+	struct slot *old, *np;
+	unsigned long i, old_size;
+
+	old = hashtab;
+	old_size = size;
+	size = new_size;
+	if ((hashtab = calloc(size, sizeof *hashtab)) == NULL)
+	{
+		fprintf(stderr, "resize: can't allocate memory for hashtab\n");
+		exit(1);
+	}
+
+	/* all words are different, no need to compare them */
+	for (i = 0; i < old_size; ++i)
+		if (old[i].word != NULL)
+		{
+			for (np = hashtab + (old[i].hash & (size - 1));
+			     np->word != NULL; )
+				np = (np + 1 == hashtab + size) ? hashtab : np + 1;
+			*np = old[i];
+		}
+	free(old);
+}
+
+/* reserve_words: make hashtab large enough to hold n words without being
+ *                resized (when the number of words to add is known) */
+void reserve_words(const long n)
+{
+	unsigned long new_size;
+
+	for (new_size = (size == 0) ? INITSIZE : size;
+	     new_size < 2 * (unsigned long) n; )
+		new_size *= 2;
+	if (new_size > size)
+		resize(new_size);
+}
+
+/* store: return a copy of string s, stored in the arena */
+static char *store(const char *s)
+{
+	size_t len;
+	char *copy, *block;
+
+	/* the previous block is kept, its words are still used */
+	len = strlen(s) + 1;
+	if (arena_used + len > arena_size)
+	{
+		arena_size = (len > ARENACHUNK) ? len : ARENACHUNK;
+		if ((block = malloc(sizeof(char *) + arena_size)) == NULL)
+		{
+			fprintf(stderr, "store: can't allocate memory for "
+			        "words\n");
+			exit(1);
+		}
+		memcpy(block, &last_block, sizeof(char *));
+		last_block = block;
+		arena = block + sizeof(char *);
+		arena_used = 0;
+	}
+	copy = arena + arena_used;
+	memcpy(copy, s, len);
+	arena_used += len;
+	return copy;
 }
 
 /* get_index: return vector index of word s, -1 if not found */
 long get_index(const char *s)
 {
-	struct nlist *np;
+	struct slot *np;
 
-	/* look for string s in hashtab */
-	for (np = hashtab[hash(s)]; np != NULL; np = np->next)
-		if (strcmp(np->word, s) == 0) /* found, return its index */
-			return np->index;
-	return -1;
+	if (size == 0)
+		return -1;
+	np = find_slot(s, hash(s));
+	return (np->word != NULL) ? (long) np->index : -1;
 }
 
-/* add_word: add word s to hashtab (only if not present). If the flag
- *           `save_word_index` is on (i.e. not zero), also add the word s into
- *           the array `words`, which is used to find a word given its index. */
-void add_word(const char *s, const int save_word_index)
+/* add_word: add word s to hashtab (only if not present) and return its index.
+ *           If the flag `save_word_index` is on (i.e. not zero), also add the
+ *           word s into the array `words`, which is used to find a word given
+ *           its index. A word is new if its index is the previous value of
+ *           n_words. */
+long add_word(const char *s, const int save_word_index)
 {
-	struct nlist *np;
+	struct slot *np;
 	unsigned int hashval = hash(s);
 
-	if (get_index(s) > -1) /* already in hashtab */
-		return;
+	/* keep hashtab at most half full, so probe sequences stay short */
+	if (2 * (unsigned long) (n_words + 1) > size)
+		resize((size == 0) ? INITSIZE : 2 * size);
 
-	/* word not in hashtab, need to add it */
-	if ((np = malloc(sizeof *np)) == NULL ||
-	    (np->word = malloc(strlen(s) + 1)) == NULL)
-		return;
+	if ((np = find_slot(s, hashval))->word != NULL) /* already in hashtab */
+		return np->index;
 
-	strcpy(np->word, s);
+	/* word not in hashtab, need to add it */
+	np->word = store(s);
+	np->hash = hashval;
+	np->index = n_words;
 
 	/* only add the word s to the array index->word if the argument flag
 	 * has been set. Need a flag because the array words is not required in
@@ -104,9 +203,30 @@ void add_word(const char *s, const int save_word_index)
 		words[n_words] = np->word;
 	}
 
-	np->next = hashtab[hashval];
-	np->index = n_words++;
-	hashtab[hashval] = np;
+	return n_words++;
+}
+
+/* clear_hashtab: remove all words from hashtab, and release the array `words`
+ *                (if it has been allocated), so that hashtab can be filled
+ *                again from scratch */
+void clear_hashtab(void)
+{
+	char *block;
+
+	for (; last_block != NULL; last_block = block)
+	{
+		memcpy(&block, last_block, sizeof(char *));
+		free(last_block);
+	}
+	free(hashtab);
+	free(words);
+	hashtab    = NULL;
+	size       = 0;
+	arena      = NULL;
+	arena_used = 0;
+	arena_size = 0;
+	n_words    = 0;
+	words      = NULL;
 }
 
 /* lower: lowercase all char of s */
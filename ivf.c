@@ -0,0 +1,290 @@
+/* Copyright (c) 2019-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of the "Near-lossless Binarization of Word Embeddings"
+ * software (https://github.com/tca19/near-lossless-binarization).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+/* Inverted file index for approximate k nearest neighbors search in Hamming
+ * space. The binary vectors are clustered with k-majority (the Hamming space
+ * version of k-means: each centroid bit is the majority bit of the vectors of
+ * the cluster), and the vectors of each cluster are stored contiguously (an
+ * inverted list). A query only scans the `nprobe` lists whose centroids are
+ * the closest to it. */
+
+#define TRAIN_PER_LIST 256  /* at most this number of vectors per list are
+                               used to train the centroids */
+
+/* nearest_centroid: return the index of the centroid closest to v */
+static int nearest_centroid(const struct ivf_index *ivf,
+	                    const unsigned long *v, int *dist)
+{
+	int i, best;
+
+	scan_rows(v, ivf->centroids, ivf->n_lists, ivf->n_long, dist);
+	for (best = 0, i = 1; i < ivf->n_lists; ++i)
+		if (dist[i] < dist[best])
+			best = i;
+	return best;
+}
+
+/* train_centroids: compute the centroids of `ivf` with `n_iter` iterations of
+ *                  k-majority on a sample of the vectors */
+static void train_centroids(struct ivf_index *ivf, const int n_iter)
+{
+	long i, n_train, *size, *count, seed;
+	int it, c, j, n_bits, *dist;
+	const unsigned long *v;
+	unsigned long *centroid;
+
+	n_bits = ivf->n_long * sizeof(long) * 8;
+	n_train = (long) TRAIN_PER_LIST * ivf->n_lists;
+	if (n_train > ivf->n_vecs)
+		n_train = ivf->n_vecs;
+
+	if ((size = malloc(ivf->n_lists * sizeof *size)) == NULL
+	 || (count = malloc(ivf->n_lists * n_bits * sizeof *count)) == NULL
+	 || (dist = malloc(ivf->n_lists * sizeof *dist)) == NULL)
+	{
+		fprintf(stderr, "train_centroids: can't allocate memory\n");
+		exit(1);
+	}
+
+	/* initial centroids are vectors spread over the whole matrix, the
+	 * training vectors are spread the same way */
+	for (c = 0; c < ivf->n_lists; ++c)
+		memcpy(ivf->centroids + c * ivf->n_long,
+		       ivf->vec + (ivf->n_vecs * c / ivf->n_lists)
+		                  * ivf->n_long,
+		       ivf->n_long * sizeof *ivf->centroids);
+
+	for (it = 0, seed = 1; it < n_iter; ++it)
+	{
+		memset(size, 0, ivf->n_lists * sizeof *size);
+		memset(count, 0, ivf->n_lists * n_bits * sizeof *count);
+
+		/* assign each training vector to its closest centroid, count
+		 * the bits set in each cluster */
+		for (i = 0; i < n_train; ++i)
+		{
+			v = ivf->vec + (ivf->n_vecs * i / n_train)
+			               * ivf->n_long;
+			c = nearest_centroid(ivf, v, dist);
+			++size[c];
+			for (j = 0; j < n_bits; ++j)
+				count[c * n_bits + j] +=
+				    (v[j / (sizeof(long) * 8)]
+				     >> (sizeof(long) * 8 - 1
+				         - j % (sizeof(long) * 8))) & 1;
+		}
+
+		/* each bit of a centroid is the majority bit of its cluster.
+		 * An empty cluster gets a new (pseudo-random) training vector
+		 * as centroid. */
+		for (c = 0; c < ivf->n_lists; ++c)
+		{
+			centroid = ivf->centroids + c * ivf->n_long;
+			if (size[c] == 0)
+			{
+				seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+				memcpy(centroid, ivf->vec + (ivf->n_vecs
+				       * (seed % n_train) / n_train)
+				       * ivf->n_long,
+				       ivf->n_long * sizeof *centroid);
+				continue;
+			}
+			memset(centroid, 0, ivf->n_long * sizeof *centroid);
+			for (j = 0; j < n_bits; ++j)
+				if (2 * count[c * n_bits + j] > size[c])
+					centroid[j / (sizeof(long) * 8)] |=
+					    1UL << (sizeof(long) * 8 - 1
+					            - j % (sizeof(long) * 8));
+		}
+	}
+
+	free(size);
+	free(count);
+	free(dist);
+}
+
+/* build_ivf: return the inverted file index of the (n_vecs, n_long) matrix vec,
+ *            with n_lists lists whose centroids are trained with n_iter
+ *            iterations of k-majority */
+struct ivf_index *build_ivf(const unsigned long *vec, const long n_vecs,
+	                    const int n_long, int n_lists, const int n_iter)
+{
+	struct ivf_index *ivf;
+	long i, *pos;
+	int *list, *dist;
+
+	if (n_lists > n_vecs)
+		n_lists = n_vecs;
+	if (n_lists < 1)
+		n_lists = 1;
+
+	if ((ivf = calloc(1, sizeof *ivf)) == NULL
+	 || (ivf->centroids = malloc(n_lists * n_long
+	                             * sizeof *ivf->centroids)) == NULL
+	 || (ivf->list_start = calloc(n_lists + 1,
+	                              sizeof *ivf->list_start)) == NULL
+	 || (ivf->ids = malloc(n_vecs * sizeof *ivf->ids)) == NULL
+	 || (list = malloc(n_vecs * sizeof *list)) == NULL
+	 || (dist = malloc(n_lists * sizeof *dist)) == NULL
+	 || (pos = malloc(n_lists * sizeof *pos)) == NULL)
+	{
+		fprintf(stderr, "build_ivf: can't allocate memory\n");
+		exit(1);
+	}
+	ivf->vec     = vec;
+	ivf->n_vecs  = n_vecs;
+	ivf->n_long  = n_long;
+	ivf->n_lists = n_lists;
+	ivf->codes   = alloc_matrix(n_vecs * n_long * sizeof *ivf->codes);
+
+	train_centroids(ivf, n_iter);
+
+	/* assign all vectors to their list, then store the lists one after
+	 * another (counting sort, so rows of a list stay in increasing order) */
+	for (i = 0; i < n_vecs; ++i)
+	{
+		list[i] = nearest_centroid(ivf, vec + i * n_long, dist);
+		++ivf->list_start[list[i] + 1];
+	}
+	for (i = 0; i < n_lists; ++i)
+	{
+		ivf->list_start[i+1] += ivf->list_start[i];
+		pos[i] = ivf->list_start[i];
+	}
+	for (i = 0; i < n_vecs; ++i)
+	{
+		ivf->ids[pos[list[i]]] = i;
+		memcpy(ivf->codes + pos[list[i]]++ * n_long, vec + i * n_long,
+		       n_long * sizeof *ivf->codes);
+	}
+
+	free(list);
+	free(dist);
+	free(pos);
+	return ivf;
+}
+
+/* free_ivf: release the memory used by the index (not the indexed matrix) */
+void free_ivf(struct ivf_index *ivf)
+{
+	free_matrix(ivf->codes, ivf->n_vecs * ivf->n_long * sizeof *ivf->codes);
+	free(ivf->centroids);
+	free(ivf->list_start);
+	free(ivf->ids);
+	free(ivf);
+}
+
+/* cmp_long: used in qsort to sort longs by increasing value */
+static int cmp_long(const void *a, const void *b)
+{
+	long la = *(const long *) a, lb = *(const long *) b;
+
+	return (la > lb) - (la < lb);
+}
+
+/* ivf_search: give to `sel` (initialized for k neighbors) the vectors of the
+ *             `nprobe` lists closest to the query vector of row `index`. The
+ *             candidates are given by increasing row, so ties are ordered
+ *             like with a linear scan. Return the number of vectors compared
+ *             to the query. */
+long ivf_search(const struct ivf_index *ivf, const long index, int nprobe,
+	        struct selection *sel)
+{
+	const unsigned long *query;
+	struct selection lists;
+	long i, j, n_rows, *probed, *cand, n_cand, count, *hist;
+	int *dist, *list_dist, n_bits, d, threshold;
+
+	query = ivf->vec + index * ivf->n_long;
+	n_bits = ivf->n_long * sizeof(long) * 8;
+	if (nprobe > ivf->n_lists)
+		nprobe = ivf->n_lists;
+
+	if ((list_dist = malloc(ivf->n_lists * sizeof *list_dist)) == NULL
+	 || (probed = malloc(nprobe * sizeof *probed)) == NULL
+	 || (hist = calloc(n_bits + 1, sizeof *hist)) == NULL)
+	{
+		fprintf(stderr, "ivf_search: can't allocate memory\n");
+		exit(1);
+	}
+
+	/* the nprobe closest lists (all distances, even n_bits, accepted) */
+	scan_rows(query, ivf->centroids, ivf->n_lists, ivf->n_long, list_dist);
+	init_selection(&lists, nprobe, n_bits + 1);
+	select_rows(&lists, list_dist, 0, ivf->n_lists, -1);
+	nprobe = finish_selection(&lists, probed, list_dist);
+	free_selection(&lists);
+
+	for (i = 0, n_rows = 0; i < nprobe; ++i)
+		n_rows += ivf->list_start[probed[i] + 1]
+		          - ivf->list_start[probed[i]];
+	if ((dist = malloc(n_rows * sizeof *dist + 1)) == NULL
+	 || (cand = malloc(n_rows * sizeof *cand + 1)) == NULL)
+	{
+		fprintf(stderr, "ivf_search: can't allocate memory\n");
+		exit(1);
+	}
+
+	/* scan the contiguous vectors of each probed list */
+	for (i = 0, n_rows = 0; i < nprobe; ++i)
+	{
+		j = ivf->list_start[probed[i]];
+		scan_rows(query, ivf->codes + j * ivf->n_long,
+		          ivf->list_start[probed[i] + 1] - j, ivf->n_long,
+		          dist + n_rows);
+		for (; j < ivf->list_start[probed[i] + 1]; ++j, ++n_rows)
+			if (ivf->ids[j] != index)
+				++hist[dist[n_rows]];
+			else
+				dist[n_rows] = n_bits; /* never selected */
+	}
+
+	/* The k-th distance among the scanned vectors does not depend on the
+	 * order of the lists. Only the vectors at most this far can be
+	 * selected; give them to `sel` by increasing row. */
+	for (threshold = 0, count = 0; threshold < n_bits - 1; ++threshold)
+		if ((count += hist[threshold]) >= sel->k)
+			break;
+	/* collect candidates, packing (row, distance) as row * (n_bits+1) +
+	 * distance so that sorting them sorts by row */
+	for (i = 0, n_rows = 0, n_cand = 0; i < nprobe; ++i)
+		for (j = ivf->list_start[probed[i]];
+		     j < ivf->list_start[probed[i] + 1]; ++j, ++n_rows)
+			if ((d = dist[n_rows]) <= threshold)
+				cand[n_cand++] = ivf->ids[j] * (n_bits + 1) + d;
+	qsort(cand, n_cand, sizeof *cand, cmp_long);
+	for (i = 0; i < n_cand; ++i)
+		push_candidate(sel, cand[i] / (n_bits + 1),
+		               cand[i] % (n_bits + 1));
+
+	free(list_dist);
+	free(probed);
+	free(hist);
+	free(dist);
+	free(cand);
+	return n_rows;
+}
@@ -0,0 +1,380 @@
+/* Copyright (c) 2019-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of the "Near-lossless Binarization of Word Embeddings"
+ * software (https://github.com/tca19/near-lossless-binarization).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _DEFAULT_SOURCE  /* mmap() */
+#include <pthread.h>     /* pthread_create(), pthread_join() */
+#include <stdio.h>       /* fprintf() */
+#include <stdlib.h>      /* calloc()  */
+#include <string.h>      /* strcmp()  */
+#include <sys/mman.h>    /* mmap()    */
+#include "utils.h"
+
+/* Compute the k nearest neighbors of all the words of a binary embedding (its
+ * k-NN graph), and query the graph file written.
+ *
+ * The graph file starts with a `struct knn_header`, followed by the (n_vecs, k)
+ * matrix of `unsigned int` rows of the neighbors of each word (at offset
+ * `index_offset`), the (n_vecs, k) matrix of `unsigned short` Hamming distances
+ * of these neighbors (at offset `dist_offset`), then the n_vecs words (each one
+ * terminated by a null character), in the order of the rows. Neighbors of a
+ * word are sorted like with topk_binary; when there are less than k neighbors
+ * with a similarity greater than 0, the list is completed with row 0 at a
+ * distance of n_bits. Matrices are aligned on KNN_ALIGN bytes, so with the file
+ * mapped in memory, the neighbors of a word are found in O(1) from its row. */
+#define KNN_MAGIC   "NLBKNNGR"  /* first 8 bytes of a graph file */
+#define KNN_VERSION 1
+#define KNN_ALIGN   64
+
+#define TILE_BYTES  (128 * 1024)  /* size of a tile of vectors (fits in L2,
+                                     see join_tiles()) */
+#define QUERY_TILE  256           /* number of words of a tile of queries */
+
+struct knn_header
+{
+	char magic[8];          /* KNN_MAGIC, without the null character */
+	unsigned int version;   /* KNN_VERSION */
+	unsigned int endian;    /* BIN_ENDIAN */
+	long n_vecs;            /* number of words */
+	long k;                 /* number of neighbors of each word */
+	long n_bits;            /* number of bits of the binary vectors */
+	long index_offset;      /* position of the neighbor rows in file */
+	long dist_offset;       /* position of the neighbor distances in file */
+	long words_offset;      /* position of the word section in file */
+	long words_size;        /* size (in bytes) of the word section */
+};
+
+/* work shared by the threads computing the graph */
+struct self_join
+{
+	const unsigned long *vec;   /* the (n_vecs, n_long) embedding matrix */
+	long n_vecs;
+	int n_long;
+	int k;
+	long tile_rows;             /* number of vectors of a tile */
+	long next_query;            /* first row of the next tile of queries */
+	unsigned int *index;        /* (n_vecs, k) neighbors of each word */
+	unsigned short *dist;       /* (n_vecs, k) distances of neighbors */
+};
+
+/* join_tiles: compute the neighbors of the tiles of QUERY_TILE queries taken
+ *             from `j` until all words are done. Each tile of queries is
+ *             compared to the whole matrix, tile after tile: a tile of
+ *             vectors stays in cache while it is compared to all the queries
+ *             of the tile. Only the vectors of the tile are counted in
+ *             TILE_BYTES, not their distances to the current query (4 bytes
+ *             per row) nor the selections of the queries: the histogram of a
+ *             selection has n_bits+1 entries, but only the few ones near its
+ *             threshold are used once it has k candidates. Used as a thread
+ *             routine, so it takes and returns a void pointer. */
+void *join_tiles(void *arg)
+{
+	struct self_join *j = arg;
+	struct selection sel[QUERY_TILE];
+	long first, n_queries, t, n_rows, q, i, n, *index;
+	int n_bits, *dist, *sel_dist;
+
+	n_bits = j->n_long * sizeof(long) * 8;
+	if ((dist = malloc(j->tile_rows * sizeof *dist)) == NULL
+	 || (index = malloc(j->k * sizeof *index)) == NULL
+	 || (sel_dist = malloc(j->k * sizeof *sel_dist)) == NULL)
+	{
+		fprintf(stderr, "join_tiles: can't allocate memory\n");
+		exit(1);
+	}
+
+	/* threads take the tiles of queries one after another */
+	while ((first = __sync_fetch_and_add(&j->next_query, QUERY_TILE))
+	       < j->n_vecs)
+	{
+		n_queries = (j->n_vecs - first < QUERY_TILE)
+		            ? j->n_vecs - first : QUERY_TILE;
+		for (q = 0; q < n_queries; ++q)
+			init_selection(sel + q, j->k, n_bits);
+
+		/* tiles are given by increasing row, so ties are ordered like
+		 * with topk_binary; a word is not its own neighbor */
+		for (t = 0; t < j->n_vecs; t += j->tile_rows)
+		{
+			n_rows = (j->n_vecs - t < j->tile_rows)
+			         ? j->n_vecs - t : j->tile_rows;
+			for (q = 0; q < n_queries; ++q)
+			{
+				scan_rows(j->vec + (first + q) * j->n_long,
+				          j->vec + t * j->n_long, n_rows,
+				          j->n_long, dist);
+				select_rows(sel + q, dist, t, n_rows, first + q);
+			}
+		}
+
+		for (q = 0; q < n_queries; ++q)
+		{
+			n = finish_selection(sel + q, index, sel_dist);
+			for (i = 0; i < j->k; ++i)
+			{
+				j->index[(first + q) * j->k + i] =
+				    (i < n) ? index[i] : 0;
+				j->dist[(first + q) * j->k + i] =
+				    (i < n) ? sel_dist[i] : n_bits;
+			}
+			free_selection(sel + q);
+		}
+	}
+
+	free(dist);
+	free(index);
+	free(sel_dist);
+	return NULL;
+}
+
+/* write_padding: write zeros in fp until its position is a multiple of
+ *                KNN_ALIGN, return the new position */
+long write_padding(FILE *fp)
+{
+	long pos;
+
+	for (pos = ftell(fp); pos % KNN_ALIGN != 0; ++pos)
+		fputc(0, fp);
+	return pos;
+}
+
+/* write_graph: write the k-NN graph of `j` into filename */
+void write_graph(const char *filename, const struct self_join *j)
+{
+	struct knn_header header;
+	FILE *fp;
+	long i;
+
+	if ((fp = fopen(filename, "wb")) == NULL)
+	{
+		fprintf(stderr, "write_graph: can't open %s\n", filename);
+		exit(1);
+	}
+
+	/* offsets are known once the sections have been written */
+	memset(&header, 0, sizeof header);
+	if (fwrite(&header, sizeof header, 1, fp) != 1)
+	{
+		fprintf(stderr, "write_graph: can't write %s\n", filename);
+		exit(1);
+	}
+	header.index_offset = write_padding(fp);
+	if (fwrite(j->index, sizeof *j->index, j->n_vecs * j->k, fp)
+	    != (size_t) (j->n_vecs * j->k))
+	{
+		fprintf(stderr, "write_graph: can't write %s\n", filename);
+		exit(1);
+	}
+	header.dist_offset = write_padding(fp);
+	if (fwrite(j->dist, sizeof *j->dist, j->n_vecs * j->k, fp)
+	    != (size_t) (j->n_vecs * j->k))
+	{
+		fprintf(stderr, "write_graph: can't write %s\n", filename);
+		exit(1);
+	}
+	header.words_offset = write_padding(fp);
+	for (i = 0; i < j->n_vecs; ++i)
+		if (fwrite(words[i], 1, strlen(words[i]) + 1, fp)
+		    != strlen(words[i]) + 1)
+		{
+			fprintf(stderr, "write_graph: can't write %s\n",
+			        filename);
+			exit(1);
+		}
+	header.words_size = ftell(fp) - header.words_offset;
+
+	memcpy(header.magic, KNN_MAGIC, sizeof header.magic);
+	header.version = KNN_VERSION;
+	header.endian  = BIN_ENDIAN;
+	header.n_vecs  = j->n_vecs;
+	header.k       = j->k;
+	header.n_bits  = j->n_long * sizeof(long) * 8;
+	if (ferror(fp) || fseek(fp, 0, SEEK_SET) != 0
+	 || fwrite(&header, sizeof header, 1, fp) != 1
+	 || fclose(fp) != 0)
+	{
+		fprintf(stderr, "write_graph: can't write %s\n", filename);
+		exit(1);
+	}
+}
+
+/* build_graph: compute the k-NN graph of the embedding with n_threads threads,
+ *              and write it into output */
+void build_graph(const char *embedding_file, const int k, const char *output,
+	         const int n_threads, long tile_rows)
+{
+	struct self_join j;
+	pthread_t *threads;
+	int i, n_bits;
+	double start;
+
+	j.vec = load_vectors(embedding_file, &j.n_vecs, &n_bits, &j.n_long,
+	                     NULL, 1);
+	if (j.n_vecs > 0xFFFFFFFFL || n_bits > 0xFFFF)
+	{
+		fprintf(stderr, "build_graph: too many words or bits\n");
+		exit(1);
+	}
+	if (tile_rows <= 0)
+		tile_rows = TILE_BYTES / (j.n_long * sizeof *j.vec);
+	j.k          = k;
+	j.tile_rows  = tile_rows;
+	j.next_query = 0;
+	if ((j.index = malloc(j.n_vecs * k * sizeof *j.index)) == NULL
+	 || (j.dist = malloc(j.n_vecs * k * sizeof *j.dist)) == NULL
+	 || (threads = calloc(n_threads, sizeof *threads)) == NULL)
+	{
+		fprintf(stderr, "build_graph: can't allocate memory\n");
+		exit(1);
+	}
+
+	start = wall_time();
+	for (i = 0; i < n_threads; ++i)
+		if (pthread_create(threads + i, NULL, join_tiles, &j) != 0)
+		{
+			fprintf(stderr, "build_graph: can't create thread\n");
+			exit(1);
+		}
+	for (i = 0; i < n_threads; ++i)
+		pthread_join(threads[i], NULL);
+	printf("> %d nearest neighbors of %ld words computed in %.3f s.\n",
+	       k, j.n_vecs, wall_time() - start);
+
+	write_graph(output, &j);
+	free(j.index);
+	free(j.dist);
+	free(threads);
+}
+
+/* print_neighbors: print the neighbors of each word of `query` (n_queries
+ *                  words) found in the graph file `filename` */
+void print_neighbors(const char *filename, char **query, int n_queries)
+{
+	const struct knn_header *header;
+	const unsigned int *index;
+	const unsigned short *dist;
+	const char *w;
+	FILE *fp;
+	char *map;
+	long size, i, row;
+
+	if ((fp = fopen(filename, "rb")) == NULL
+	 || fseek(fp, 0, SEEK_END) != 0
+	 || (size = ftell(fp)) < (long) sizeof *header
+	 || (map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0))
+	    == MAP_FAILED)
+	{
+		fprintf(stderr, "print_neighbors: can't read %s\n", filename);
+		exit(1);
+	}
+	fclose(fp);
+
+	header = (const struct knn_header *) map;
+	if (memcmp(header->magic, KNN_MAGIC, sizeof header->magic) != 0
+	 || header->endian != BIN_ENDIAN || header->version > KNN_VERSION
+	 || header->words_offset + header->words_size > size)
+	{
+		fprintf(stderr, "print_neighbors: %s is not a graph file of "
+		        "this machine\n", filename);
+		exit(1);
+	}
+	index = (const unsigned int *) (map + header->index_offset);
+	dist  = (const unsigned short *) (map + header->dist_offset);
+
+	/* rows of the words, to find the neighbors of a word in O(1) */
+	if ((words = malloc(header->n_vecs * sizeof *words)) == NULL)
+	{
+		fprintf(stderr, "print_neighbors: can't allocate memory\n");
+		exit(1);
+	}
+	reserve_words(header->n_vecs);
+	for (i = 0, w = map + header->words_offset; i < header->n_vecs;
+	     ++i, w += strlen(w) + 1)
+		add_word(w, 1);
+
+	for (; n_queries > 0; --n_queries, ++query)
+	{
+		if ((row = get_index(*query)) < 0)
+		{
+			printf("%s doesn't have a vector; can't find its"
+			       " nearest neighbors.\n\n", *query);
+			continue;
+		}
+		printf("Top %ld closest words of %s\n", header->k, *query);
+		for (i = row * header->k; i < (row + 1) * header->k; ++i)
+			printf("  %-15s %.3f\n", words[index[i]],
+			       (header->n_bits - dist[i])
+			       / (float) header->n_bits);
+		printf("\n");
+	}
+	munmap(map, size);
+}
+
+int main(int argc, char *argv[])
+{
+	int n_threads;
+	long tile_rows;
+	char *graph_file;           /* graph to query, NULL to build one */
+
+	n_threads  = 1;
+	tile_rows  = 0;
+	graph_file = NULL;
+	for (; argc > 1 && argv[1][0] == '-'; --argc, ++argv)
+	{
+		if (strcmp(argv[1], "-interleave") == 0)
+			numa_interleave = 1;
+		else if (strcmp(argv[1], "-threads") == 0 && argc > 2)
+		{
+			if ((n_threads = atoi(argv[2])) < 1)
+				n_threads = 1;
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-tile") == 0 && argc > 2)
+		{
+			tile_rows = atol(argv[2]);
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-read") == 0 && argc > 2)
+		{
+			graph_file = argv[2];
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else
+			fprintf(stderr, "main: unknown flag %s\n", argv[1]);
+	}
+
+	if (graph_file != NULL)
+	{
+		print_neighbors(graph_file, argv + 1, argc - 1);
+		return 0;
+	}
+
+	if (argc != 4 || atoi(argv[2]) < 1)
+	{
+		printf("usage: ./knn_graph [-interleave] [-threads N] "
+		       "[-tile ROWS] EMBEDDING K OUTPUT\n"
+		       "       ./knn_graph -read GRAPH WORD...\n");
+		exit(1);
+	}
+
+	build_graph(argv[1], atoi(argv[2]), argv[3], n_threads, tile_rows);
+	return 0;
+}
@@ -0,0 +1,151 @@
+/* Copyright (c) 2019-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of the "Near-lossless Binarization of Word Embeddings"
+ * software (https://github.com/tca19/near-lossless-binarization).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _DEFAULT_SOURCE      /* clock_gettime() */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "utils.h"
+
+/* Latencies are recorded in nanoseconds in a log-linear histogram (like HDR
+ * histograms): values smaller than 2*LAT_SUB have their own bucket, larger
+ * values are grouped by power of 2, each power being split into LAT_SUB
+ * buckets. The relative error of a reported percentile is at most
+ * 1/(2*LAT_SUB). */
+
+/* wall_time: return the time (in seconds) of a monotonic clock, only
+ *            meaningful to measure durations */
+double wall_time(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* bucket: return the bucket of the histogram of latency ns */
+static int bucket(unsigned long ns)
+{
+	int e;
+
+	if (ns < 2 * LAT_SUB)
+		return ns;
+	for (e = 0; (ns >> e) >= 2 * LAT_SUB; ++e)
+		;
+	return e * LAT_SUB + (ns >> e);
+}
+
+/* bucket_value: return the latency (in nanoseconds) represented by bucket b,
+ *               the middle of the latencies it contains */
+static double bucket_value(int b)
+{
+	int e;
+
+	if (b < 2 * LAT_SUB)
+		return b;
+	e = b / LAT_SUB - 1;
+	return (double) ((unsigned long) (b - e * LAT_SUB) << e)
+	       + ((1UL << e) - 1) / 2.0;
+}
+
+/* init_latency: reset the histogram and start the wall-clock timer used to
+ *               compute the throughput */
+void init_latency(struct latency *lat)
+{
+	memset(lat, 0, sizeof *lat);
+	lat->start = wall_time();
+}
+
+/* record_latency: record n_queries queries answered in `seconds` (each one),
+ *                 for which n_rows vectors were compared to a query. Can be
+ *                 called by several threads at once. */
+void record_latency(struct latency *lat, const double seconds,
+	            const long n_queries, const long n_rows)
+{
+	double ns;
+	int b;
+
+	ns = seconds * 1e9;
+	b = bucket(ns > 0 ? (unsigned long) ns : 0);
+	if (b >= LAT_BUCKETS)
+		b = LAT_BUCKETS - 1;
+	__sync_fetch_and_add(lat->count + b, n_queries);
+	__sync_fetch_and_add(&lat->n_queries, n_queries);
+	__sync_fetch_and_add(&lat->n_rows, n_rows);
+}
+
+/* percentile: return the latency (in milliseconds) under which are the
+ *             fraction p of the recorded queries */
+static double percentile(const struct latency *lat, const double p)
+{
+	long seen, rank;
+	int b;
+
+	/* rank (from 0) of the first query such that a fraction p of the
+	 * queries are at most as slow */
+	rank = (long) (p * lat->n_queries);
+	if (rank > 0 && rank == p * lat->n_queries)
+		--rank;
+	if (rank >= lat->n_queries)
+		rank = lat->n_queries - 1;
+	for (b = 0, seen = 0; b < LAT_BUCKETS; ++b)
+		if ((seen += lat->count[b]) > rank)
+			break;
+	return bucket_value(b) / 1e6;
+}
+
+/* print_latency: print to fp the percentiles of the recorded latencies and the
+ *                throughput since init_latency(), as JSON if `json` is set */
+void print_latency(const struct latency *lat, FILE *fp, const int json)
+{
+	double elapsed;
+	int b;
+
+	elapsed = wall_time() - lat->start;
+	if (lat->n_queries == 0 || elapsed <= 0)
+	{
+		fprintf(fp, json ? "{\"queries\": 0}\n" : "> No query.\n");
+		return;
+	}
+	for (b = LAT_BUCKETS - 1; b > 0 && lat->count[b] == 0; --b)
+		;
+
+	if (json)
+		fprintf(fp, "{\"queries\": %ld, \"seconds\": %.6f, "
+		        "\"qps\": %.3f, \"rows_per_second\": %.6g, "
+		        "\"latency_ms\": {\"p50\": %.6f, \"p90\": %.6f, "
+		        "\"p99\": %.6f, \"p999\": %.6f, \"max\": %.6f}}\n",
+		        lat->n_queries, elapsed, lat->n_queries / elapsed,
+		        lat->n_rows / elapsed, percentile(lat, 0.5),
+		        percentile(lat, 0.9), percentile(lat, 0.99),
+		        percentile(lat, 0.999), bucket_value(b) / 1e6);
+	else
+	{
+		fprintf(fp, "> %ld queries in %.3f s: %.1f queries/s, %.4g "
+		        "rows scanned/s.\n", lat->n_queries, elapsed,
+		        lat->n_queries / elapsed, lat->n_rows / elapsed);
+		fprintf(fp, "> Latency (ms): p50 %.3f, p90 %.3f, p99 %.3f, "
+		        "p999 %.3f, max %.3f.\n", percentile(lat, 0.5),
+		        percentile(lat, 0.9), percentile(lat, 0.99),
+		        percentile(lat, 0.999), bucket_value(b) / 1e6);
+	}
+}
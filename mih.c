@@ -0,0 +1,528 @@
+/* Copyright (c) 2019-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of the "Near-lossless Binarization of Word Embeddings"
+ * software (https://github.com/tca19/near-lossless-binarization).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+/* Multi-index hashing (Norouzi et al., 2012) for exact k nearest neighbors
+ * search in Hamming space. Each binary vector is split into m substrings of b
+ * bits, and each substring is indexed into its own hash table. If two vectors
+ * are at a Hamming distance smaller than m * (r + 1), at least one of their
+ * substrings differs by at most r bits (pigeonhole principle). So a query
+ * probes all the tables with all the substrings at distance 0 of its own
+ * substrings, then 1, 2, ... until its k-th neighbor is closer than m * (r + 1):
+ * all the vectors not seen yet are necessarily farther. */
+
+#define MIH_MAGIC   "NLBMIHIX"  /* first 8 bytes of a saved index */
+#define MIH_VERSION 1
+#define PROBE_COST     128 /* cost of probing a bucket, in rows of a scan */
+#define CANDIDATE_COST 8   /* cost of checking a candidate, in rows of a scan */
+
+/* header of a saved index, followed by the arrays of each table */
+struct mih_header
+{
+	char magic[8];          /* MIH_MAGIC, without the null character */
+	unsigned int version;   /* MIH_VERSION */
+	unsigned int endian;    /* BIN_ENDIAN */
+	long n_vecs;            /* number of indexed vectors */
+	long n_bits;            /* number of bits of each vector */
+	unsigned long checksum; /* checksum of the indexed matrix */
+	int sub_bits;           /* number of bits of each substring */
+	int n_tables;           /* number of substrings */
+};
+
+/* substring: return the i-th substring of `sub_bits` bits of vector v */
+static unsigned int substring(const unsigned long *v, const int i,
+	                      const int sub_bits)
+{
+	int pos, shift;
+
+	/* sub_bits divides 64 so a substring never spans two long; bits are
+	 * numbered from the most significant bit of each long */
+	pos = i * sub_bits;
+	shift = sizeof(long) * 8 - sub_bits - pos % (sizeof(long) * 8);
+	return (v[pos / (sizeof(long) * 8)] >> shift)
+	       & (~0UL >> (sizeof(long) * 8 - sub_bits));
+}
+
+/* slot: return the slot of table t where `key` is, or where it should be
+ *       inserted (linear probing) */
+static unsigned long slot(const struct mih_table *t, const unsigned int key)
+{
+	unsigned long s;
+
+	/* multiplicative hashing (Knuth), size is a power of 2 */
+	for (s = (key * 2654435761UL) & (t->size - 1);
+	     t->count[s] != 0 && t->keys[s] != key;
+	     s = (s + 1) & (t->size - 1))
+		;
+	return s;
+}
+
+/* matrix_checksum: return a FNV-1a checksum of the matrix, saved with the index
+ *                  to detect that the vector file changed since */
+static unsigned long matrix_checksum(const unsigned long *vec, const long n)
+{
+	unsigned long h;
+	long i;
+
+	for (h = 14695981039346656037UL, i = 0; i < n; ++i)
+		h = (h ^ vec[i]) * 1099511628211UL;
+	return h;
+}
+
+/* build_table: index the `table`-th substring of each vector into t */
+static void build_table(struct mih_index *mih, const int table,
+	                struct mih_table *t)
+{
+	unsigned int *keys, *tmp_keys, *tmp_ids, *swap;
+	unsigned long s, *count;
+	long i, n_keys;
+	int shift, digit_bits, n_digits;
+
+	if ((keys = malloc(mih->n_vecs * sizeof *keys)) == NULL
+	 || (tmp_keys = malloc(mih->n_vecs * sizeof *tmp_keys)) == NULL
+	 || (tmp_ids = malloc(mih->n_vecs * sizeof *tmp_ids)) == NULL
+	 || (t->ids = malloc(mih->n_vecs * sizeof *t->ids)) == NULL)
+	{
+		fprintf(stderr, "build_table: can't allocate memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < mih->n_vecs; ++i)
+	{
+		keys[i] = substring(mih->vec + i * mih->n_long, table,
+		                    mih->sub_bits);
+		t->ids[i] = i;
+	}
+
+	/* group the rows by substring value with a LSD radix sort on digits
+	 * of (at most) 16 bits. Radix sort is stable, so rows of a bucket are
+	 * sorted by increasing index. */
+	digit_bits = (mih->sub_bits < 16) ? mih->sub_bits : 16;
+	n_digits = mih->sub_bits / digit_bits;
+	if ((count = malloc(((1UL << digit_bits) + 1) * sizeof *count)) == NULL)
+	{
+		fprintf(stderr, "build_table: can't allocate memory\n");
+		exit(1);
+	}
+	for (shift = 0; n_digits-- > 0; shift += digit_bits)
+	{
+		memset(count, 0, ((1UL << digit_bits) + 1) * sizeof *count);
+		for (i = 0; i < mih->n_vecs; ++i)
+			++count[((keys[i] >> shift)
+			         & ((1UL << digit_bits) - 1)) + 1];
+		for (s = 0; s < (1UL << digit_bits); ++s)
+			count[s+1] += count[s];
+		for (i = 0; i < mih->n_vecs; ++i)
+		{
+			s = count[(keys[i] >> shift)
+			          & ((1UL << digit_bits) - 1)]++;
+			tmp_keys[s] = keys[i];
+			tmp_ids[s] = t->ids[i];
+		}
+		swap = keys;    keys = tmp_keys;   tmp_keys = swap;
+		swap = t->ids;  t->ids = tmp_ids;  tmp_ids = swap;
+	}
+	free(count);
+
+	/* the hash table is at most half full */
+	for (i = 0, n_keys = 0; i < mih->n_vecs; ++i)
+		n_keys += (i == 0 || keys[i] != keys[i-1]);
+	for (t->size = 1; t->size < 2 * (unsigned long) n_keys; t->size <<= 1)
+		;
+	if ((t->keys = malloc(t->size * sizeof *t->keys)) == NULL
+	 || (t->start = malloc(t->size * sizeof *t->start)) == NULL
+	 || (t->count = calloc(t->size, sizeof *t->count)) == NULL)
+	{
+		fprintf(stderr, "build_table: can't allocate memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < mih->n_vecs; ++i)
+	{
+		s = slot(t, keys[i]);
+		if (t->count[s] == 0)
+		{
+			t->keys[s] = keys[i];
+			t->start[s] = i;
+		}
+		++t->count[s];
+	}
+
+	free(keys);
+	free(tmp_keys);
+	free(tmp_ids);
+}
+
+/* build_mih: return the multi-index hashing index of the (n_vecs, n_long)
+ *            matrix vec, with substrings of `sub_bits` bits (8, 16 or 32).
+ *            If `sub_bits` is 0, it is chosen from the number of vectors. */
+struct mih_index *build_mih(const unsigned long *vec, const long n_vecs,
+	                    const int n_long, int sub_bits)
+{
+	struct mih_index *mih;
+	int i;
+
+	/* substrings of about log2(n_vecs) bits give buckets of about one
+	 * vector each */
+	if (sub_bits == 0)
+		sub_bits = (n_vecs < (1L << 12)) ? 8
+		         : (n_vecs < (1L << 24)) ? 16 : 32;
+	if (sub_bits != 8 && sub_bits != 16 && sub_bits != 32)
+	{
+		fprintf(stderr, "build_mih: substrings must have 8, 16 or 32 "
+		        "bits\n");
+		exit(1);
+	}
+
+	if ((mih = calloc(1, sizeof *mih)) == NULL)
+	{
+		fprintf(stderr, "build_mih: can't allocate memory\n");
+		exit(1);
+	}
+	mih->vec      = vec;
+	mih->n_vecs   = n_vecs;
+	mih->n_long   = n_long;
+	mih->sub_bits = sub_bits;
+	mih->n_tables = n_long * sizeof(long) * 8 / sub_bits;
+	if ((mih->tables = calloc(mih->n_tables, sizeof *mih->tables)) == NULL)
+	{
+		fprintf(stderr, "build_mih: can't allocate memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < mih->n_tables; ++i)
+		build_table(mih, i, mih->tables + i);
+	return mih;
+}
+
+/* free_mih: release the memory used by the index (not the indexed matrix) */
+void free_mih(struct mih_index *mih)
+{
+	int i;
+
+	for (i = 0; i < mih->n_tables; ++i)
+	{
+		free(mih->tables[i].keys);
+		free(mih->tables[i].start);
+		free(mih->tables[i].count);
+		free(mih->tables[i].ids);
+	}
+	free(mih->tables);
+	free(mih);
+}
+
+/* save_mih: write the index into `filename` */
+void save_mih(const struct mih_index *mih, const char *filename)
+{
+	FILE *fo;
+	struct mih_header header;
+	const struct mih_table *t;
+	int i, error;
+
+	if ((fo = fopen(filename, "wb")) == NULL)
+	{
+		fprintf(stderr, "save_mih: can't open %s\n", filename);
+		exit(1);
+	}
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, MIH_MAGIC, sizeof header.magic);
+	header.version  = MIH_VERSION;
+	header.endian   = BIN_ENDIAN;
+	header.n_vecs   = mih->n_vecs;
+	header.n_bits   = mih->n_long * sizeof(long) * 8;
+	header.checksum = matrix_checksum(mih->vec, mih->n_vecs * mih->n_long);
+	header.sub_bits = mih->sub_bits;
+	header.n_tables = mih->n_tables;
+
+	error = fwrite(&header, sizeof header, 1, fo) != 1;
+	for (i = 0; i < mih->n_tables && !error; ++i)
+	{
+		t = mih->tables + i;
+		error = fwrite(&t->size, sizeof t->size, 1, fo) != 1
+		     || fwrite(t->keys, sizeof *t->keys, t->size, fo) != t->size
+		     || fwrite(t->start, sizeof *t->start, t->size, fo)
+		        != t->size
+		     || fwrite(t->count, sizeof *t->count, t->size, fo)
+		        != t->size
+		     || fwrite(t->ids, sizeof *t->ids, mih->n_vecs, fo)
+		        != (size_t) mih->n_vecs;
+	}
+
+	if (fclose(fo) != 0 || error)
+	{
+		fprintf(stderr, "save_mih: can't write %s\n", filename);
+		exit(1);
+	}
+}
+
+/* load_mih: return the index saved into `filename`, or NULL if the file does
+ *           not exist or has not been built for the (n_vecs, n_long) matrix
+ *           vec */
+struct mih_index *load_mih(const char *filename, const unsigned long *vec,
+	                   const long n_vecs, const int n_long)
+{
+	FILE *fp;
+	struct mih_header header;
+	struct mih_index *mih;
+	struct mih_table *t;
+	int i;
+
+	if ((fp = fopen(filename, "rb")) == NULL)
+		return NULL;
+
+	if (fread(&header, sizeof header, 1, fp) != 1
+	 || memcmp(header.magic, MIH_MAGIC, sizeof header.magic) != 0
+	 || header.version != MIH_VERSION || header.endian != BIN_ENDIAN
+	 || header.n_vecs != n_vecs
+	 || header.n_bits != (long) (n_long * sizeof(long) * 8)
+	 || header.checksum != matrix_checksum(vec, n_vecs * n_long))
+	{
+		fprintf(stderr, "load_mih: %s has not been built for these "
+		        "vectors, ignored\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	if ((mih = calloc(1, sizeof *mih)) == NULL
+	 || (mih->tables = calloc(header.n_tables, sizeof *mih->tables))
+	    == NULL)
+	{
+		fprintf(stderr, "load_mih: can't allocate memory\n");
+		exit(1);
+	}
+	mih->vec      = vec;
+	mih->n_vecs   = n_vecs;
+	mih->n_long   = n_long;
+	mih->sub_bits = header.sub_bits;
+	mih->n_tables = header.n_tables;
+
+	for (i = 0; i < mih->n_tables; ++i)
+	{
+		t = mih->tables + i;
+		if (fread(&t->size, sizeof t->size, 1, fp) != 1
+		 || (t->keys = malloc(t->size * sizeof *t->keys)) == NULL
+		 || (t->start = malloc(t->size * sizeof *t->start)) == NULL
+		 || (t->count = malloc(t->size * sizeof *t->count)) == NULL
+		 || (t->ids = malloc(n_vecs * sizeof *t->ids)) == NULL
+		 || fread(t->keys, sizeof *t->keys, t->size, fp) != t->size
+		 || fread(t->start, sizeof *t->start, t->size, fp) != t->size
+		 || fread(t->count, sizeof *t->count, t->size, fp) != t->size
+		 || fread(t->ids, sizeof *t->ids, n_vecs, fp)
+		    != (size_t) n_vecs)
+		{
+			fprintf(stderr, "load_mih: %s is truncated\n",
+			        filename);
+			exit(1);
+		}
+	}
+
+	fclose(fp);
+	return mih;
+}
+
+/* cmp_candidate: used in qsort to sort candidates by increasing row */
+static int cmp_candidate(const void *a, const void *b)
+{
+	long ia = ((const struct mih_candidate *) a)->index;
+	long ib = ((const struct mih_candidate *) b)->index;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/* probe: add to the candidates of `ws` all the rows of bucket `key` of table t
+ *        not seen yet, with their distance to `query` */
+static void probe(const struct mih_index *mih, const struct mih_table *t,
+	          const unsigned int key, const unsigned long *query,
+	          struct mih_workspace *ws)
+{
+	unsigned long s;
+	unsigned int i, id;
+
+	s = slot(t, key);
+	for (i = 0; i < t->count[s]; ++i)
+	{
+		id = t->ids[t->start[s] + i];
+		if (ws->seen[id] == ws->stamp)
+			continue;
+		ws->seen[id] = ws->stamp;
+
+		if (ws->n_cand == ws->max_cand)
+		{
+			ws->max_cand *= 2;
+			if ((ws->cand = realloc(ws->cand, ws->max_cand
+			                        * sizeof *ws->cand)) == NULL)
+			{
+				fprintf(stderr, "probe: can't allocate "
+				        "memory\n");
+				exit(1);
+			}
+		}
+		ws->cand[ws->n_cand].index = id;
+		ws->cand[ws->n_cand].dist = hamming(query,
+		        mih->vec + (long) id * mih->n_long, mih->n_long);
+		++ws->hist[ws->cand[ws->n_cand].dist];
+		++ws->n_cand;
+	}
+}
+
+/* radius_cost: return the cost (in rows of a scan) of probing the C(b, r) keys
+ *              at distance r of each table, and of checking the n_vecs / 2^b
+ *              rows expected in each bucket, with b the bits of a substring */
+static unsigned long radius_cost(const struct mih_index *mih, const int r)
+{
+	unsigned long probes;
+	int i;
+
+	for (probes = 1, i = 1; i <= r; ++i)
+		probes = probes * (mih->sub_bits - i + 1) / i;
+	return probes * mih->n_tables * (PROBE_COST + CANDIDATE_COST
+	       * ((unsigned long) mih->n_vecs >> mih->sub_bits));
+}
+
+/* init_mih_workspace: prepare the memory needed by mih_search() for queries
+ *                     on `mih`. Each thread searching the same index needs its
+ *                     own workspace. */
+void init_mih_workspace(struct mih_workspace *ws, const struct mih_index *mih)
+{
+	ws->stamp    = 0;
+	ws->n_cand   = 0;
+	ws->max_cand = 1024;
+	ws->radius   = 0;
+	if ((ws->seen = calloc(mih->n_vecs, sizeof *ws->seen)) == NULL
+	 || (ws->cand = malloc(ws->max_cand * sizeof *ws->cand)) == NULL
+	 || (ws->hist = malloc((mih->n_long * sizeof(long) * 8 + 1)
+	                       * sizeof *ws->hist)) == NULL)
+	{
+		fprintf(stderr, "init_mih_workspace: can't allocate memory\n");
+		exit(1);
+	}
+}
+
+/* free_mih_workspace: release the memory used by the workspace */
+void free_mih_workspace(struct mih_workspace *ws)
+{
+	free(ws->seen);
+	free(ws->cand);
+	free(ws->hist);
+}
+
+/* mih_search: give to `sel` (initialized for k neighbors) the vectors of the
+ *             index closest to the query vector of row `index`. The k vectors
+ *             kept by `sel` are exactly the ones a linear scan would keep.
+ *             Return the number of vectors compared to the query. */
+long mih_search(const struct mih_index *mih, struct mih_workspace *ws,
+	        const long index, struct selection *sel)
+{
+	const unsigned long *query;
+	unsigned long mask, lowest, ripple, cost;
+	long i, closer;
+	int r, t, b, d, n_bits, dist[1024];
+	unsigned int key;
+
+	query = mih->vec + index * mih->n_long;
+	n_bits = mih->n_long * sizeof(long) * 8;
+	b = mih->sub_bits;
+
+	/* a new stamp marks all rows as not seen; clear the marks when the
+	 * stamp wraps around */
+	if (++ws->stamp == 0)
+	{
+		memset(ws->seen, 0, mih->n_vecs * sizeof *ws->seen);
+		ws->stamp = 1;
+	}
+	ws->n_cand = 0;
+	memset(ws->hist, 0, (n_bits + 1) * sizeof *ws->hist);
+
+	/* the query is not its own neighbor */
+	ws->seen[index] = ws->stamp;
+
+	/* The radius the search stops at is predicted from the previous query
+	 * (the queries of a batch have the same k and their neighbors are at
+	 * similar distances). If probing up to it would cost more than
+	 * scanning the whole matrix, scan it without probing anything. */
+	for (r = 0, cost = 0;
+	     r <= ws->radius && cost <= (unsigned long) mih->n_vecs; ++r)
+		cost += radius_cost(mih, r);
+
+	for (r = 0; cost <= (unsigned long) mih->n_vecs && r <= b; ++r)
+	{
+		/* the radius was underestimated: the probes already done are
+		 * lost either way, so only scan if the next radius alone would
+		 * cost more than a scan */
+		if (radius_cost(mih, r) > (unsigned long) mih->n_vecs)
+			break;
+
+		/* enumerate all b-bit masks with r bits set (Gosper's hack) */
+		for (t = 0; t < mih->n_tables; ++t)
+		{
+			key = substring(query, t, b);
+			for (mask = (1UL << r) - 1; mask < (1UL << b); )
+			{
+				probe(mih, mih->tables + t, key ^ mask, query,
+				      ws);
+				if (mask == 0)
+					break;
+				lowest = mask & -mask;
+				ripple = mask + lowest;
+				mask = (((ripple ^ mask) >> 2) / lowest) | ripple;
+			}
+		}
+
+		/* all vectors not seen have at least r+1 different bits in each
+		 * substring. Stop if k candidates are closer than that (and
+		 * have a similarity greater than 0). */
+		for (d = 0, closer = 0;
+		     d < (r + 1) * mih->n_tables && d < n_bits; ++d)
+			closer += ws->hist[d];
+		if (closer >= sel->k || r == b)
+		{
+			ws->radius = r;
+			/* the selection needs candidates by increasing row to
+			 * order ties like a linear scan */
+			qsort(ws->cand, ws->n_cand, sizeof *ws->cand,
+			      cmp_candidate);
+			for (i = 0; i < ws->n_cand; ++i)
+				push_candidate(sel, ws->cand[i].index,
+				               ws->cand[i].dist);
+			return ws->n_cand;
+		}
+	}
+
+	/* linear scan of the whole matrix */
+	for (i = 0; i < mih->n_vecs; i += 1024)
+	{
+		d = (mih->n_vecs - i < 1024) ? mih->n_vecs - i : 1024;
+		scan_rows(query, mih->vec + i * mih->n_long, d, mih->n_long,
+		          dist);
+		select_rows(sel, dist, i, d, index);
+	}
+
+	/* the k-th neighbor is at the threshold distance, found by a search
+	 * of radius threshold / n_tables */
+	ws->radius = sel->threshold / mih->n_tables;
+	return mih->n_vecs;
+}
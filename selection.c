@@ -0,0 +1,153 @@
+/* Copyright (c) 2019-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of the "Near-lossless Binarization of Word Embeddings"
+ * software (https://github.com/tca19/near-lossless-binarization).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+/* Selection of the k nearest neighbors from integer Hamming distances. Since
+ * distances are in [0, n_bits], the engine counts how many candidates it kept
+ * for each distance (histogram) and only accepts new candidates whose distance
+ * is below a threshold, tightened each time at least k kept candidates are
+ * closer than it. Candidates are appended to a buffer which is compacted when
+ * full, so each candidate costs O(1) amortized whatever k is. The final order
+ * is obtained with a counting sort on distances. Candidates must be given by
+ * increasing index: on equal distances, the first given ones are kept, so ties
+ * are ordered by increasing index. */
+
+/* init_selection: prepare `s` to select the k closest candidates, with
+ *                 distances in [0, n_bits]. Only candidates with a distance
+ *                 strictly smaller than n_bits (i.e. with a similarity greater
+ *                 than 0) are accepted. */
+void init_selection(struct selection *s, const int k, const int n_bits)
+{
+	s->k         = k;
+	s->n_bits    = n_bits;
+	s->threshold = n_bits - 1;
+	s->n_kept    = 0;
+	s->n_cand    = 0;
+	s->max_cand  = 4 * (long) k + 16;
+	if ((s->hist = calloc(n_bits + 1, sizeof *s->hist)) == NULL
+	 || (s->cand_index = malloc(s->max_cand * sizeof *s->cand_index))
+	    == NULL
+	 || (s->cand_dist = malloc(s->max_cand * sizeof *s->cand_dist))
+	    == NULL)
+	{
+		fprintf(stderr, "init_selection: can't allocate memory\n");
+		exit(1);
+	}
+}
+
+/* free_selection: release the memory used by `s` */
+void free_selection(struct selection *s)
+{
+	free(s->hist);
+	free(s->cand_index);
+	free(s->cand_dist);
+}
+
+/* compact: remove from the buffer of `s` the candidates whose distance became
+ *          greater than the threshold, keeping the order of the others */
+static void compact(struct selection *s)
+{
+	long i, n;
+
+	for (i = n = 0; i < s->n_cand; ++i)
+		if (s->cand_dist[i] <= s->threshold)
+		{
+			s->cand_index[n] = s->cand_index[i];
+			s->cand_dist[n]  = s->cand_dist[i];
+			++n;
+		}
+	s->n_cand = n;
+}
+
+/* push_candidate: give to `s` the candidate `index`, at distance `dist` */
+void push_candidate(struct selection *s, const long index, const int dist)
+{
+	/* there are already k kept candidates closer or as close (given
+	 * before, so with a smaller index) */
+	if (dist > s->threshold || (dist == s->threshold && s->n_kept >= s->k))
+		return;
+
+	if (s->n_cand == s->max_cand)
+		compact(s);
+	s->cand_index[s->n_cand] = index;
+	s->cand_dist[s->n_cand]  = dist;
+	++s->n_cand;
+	++s->hist[dist];
+	++s->n_kept;
+
+	/* if at least k candidates are strictly closer than the threshold,
+	 * candidates at the threshold distance can't be in the top-k anymore */
+	while (s->threshold > 0 && s->n_kept - s->hist[s->threshold] >= s->k)
+	{
+		s->n_kept -= s->hist[s->threshold];
+		s->hist[s->threshold--] = 0;
+	}
+}
+
+/* select_rows: give to `s` the rows first, ..., first+n_rows-1 whose distances
+ *              are in `dist`, except row `skip` */
+void select_rows(struct selection *s, const int *dist, const long first,
+	         const long n_rows, const long skip)
+{
+	long i;
+
+	for (i = 0; i < n_rows; ++i)
+		if (dist[i] <= s->threshold && first + i != skip)
+			push_candidate(s, first + i, dist[i]);
+}
+
+/* finish_selection: store in `index` and `dist` the (at most k) selected
+ *                   candidates, sorted by increasing distance, then by the
+ *                   order they were given. Return their number. */
+long finish_selection(struct selection *s, long *index, int *dist)
+{
+	long i, n, *start;
+	int d;
+
+	if ((start = calloc(s->threshold + 2, sizeof *start)) == NULL)
+	{
+		fprintf(stderr, "finish_selection: can't allocate memory\n");
+		exit(1);
+	}
+
+	/* counting sort: start[d] is the position of the first candidate of
+	 * distance d, candidates beyond the first k are not needed */
+	for (d = 0; d <= s->threshold; ++d)
+		start[d+1] = start[d] + s->hist[d];
+	n = (start[s->threshold + 1] < s->k) ? start[s->threshold + 1] : s->k;
+
+	for (i = 0; i < s->n_cand; ++i)
+	{
+		d = s->cand_dist[i];
+		if (d > s->threshold || start[d] >= n)
+			continue;
+		index[start[d]] = s->cand_index[i];
+		dist[start[d]++] = d;
+	}
+
+	free(start);
+	return n;
+}
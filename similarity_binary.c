@@ -29,7 +29,8 @@ int main(int argc, char *argv[])
 {
 	int n_bits, n_long;         /* #bits per vector, #long per array */
 	long n_vecs;                /* #vectors in embedding file */
-	unsigned long **embedding;
+	unsigned long *embedding;
+	char *has_vector;           /* whether each word has a vector */
 	clock_t start, end;
 
 	if (argc != 2)
@@ -44,12 +45,13 @@ int main(int argc, char *argv[])
 	printf("create_vocab(): %fs\n", (double) (end-start) / CLOCKS_PER_SEC);
 
 	start = clock();
-	embedding = load_vectors(*++argv, &n_vecs, &n_bits, &n_long, 0);
+	embedding = load_vectors(*++argv, &n_vecs, &n_bits, &n_long,
+	                         &has_vector, 0);
 	end = clock();
 	printf("load_vectors(): %fs\n", (double) (end-start) / CLOCKS_PER_SEC);
 
 	start = clock();
-	evaluate(DATADIR, (void**) embedding, n_long, binary_sim);
+	evaluate(DATADIR, embedding, has_vector, n_long, binary_sim);
 	end = clock();
 	printf("evaluate(): %fs\n", (double) (end-start) / CLOCKS_PER_SEC);
 
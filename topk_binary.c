@@ -19,85 +19,856 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _DEFAULT_SOURCE  /* fdopen(), sockets */
+#include <errno.h>       /* errno */
+#include <pthread.h>     /* pthread_create(), pthread_join() */
+#include <signal.h>      /* signal(), sigwait() */
 #include <stdio.h>       /* fprintf() */
 #include <stdlib.h>      /* calloc()  */
-#include <time.h>        /* clock()   */
+#include <string.h>      /* strcmp()  */
+#include <sys/socket.h>  /* socket(), bind(), listen(), accept() */
+#include <sys/un.h>      /* struct sockaddr_un */
+#include <unistd.h>      /* close(), dup(), sleep(), unlink() */
 #include "utils.h"
 
+#define SCAN_BLOCK 1024 /* number of rows whose distances are computed at once */
+#define MAXLENWORD 256  /* maximum length of a query word in batch mode */
+#define IVF_ITER   10   /* number of k-majority iterations to build the IVF */
+#define MAXLENLINE 512  /* maximum length of a request line in server mode */
+
+/* Where the progress messages are printed: the standard output, except when
+ * it is used to answer the requests of server mode. */
+static FILE *info;
+
 struct neighbor
 {
 	long index;
 	float similarity;
 };
 
-/* find_topk: return the k nearest neighbors of word */
-struct neighbor *find_topk(const char *word, const int k, const long n_vecs,
-		           const int n_long,  unsigned long **vec)
+/* part of the embedding matrix scanned by one thread for a batch of top-k
+ * queries */
+struct scan_range
+{
+	const unsigned long *vec;   /* the whole embedding matrix */
+	int n_long;                 /* #long per vector */
+	int n_queries;              /* number of queries in the batch */
+	const long *index;          /* row of each query word */
+	long start, end;            /* scan the rows start, ..., end-1 */
+	struct selection *sel;      /* local top-k selection of each query */
+};
+
+/* everything needed to answer top-k queries */
+struct searcher
+{
+	const unsigned long *vec;   /* the (n_vecs, n_long) embedding matrix */
+	long n_vecs;
+	int n_long;
+	int n_threads;              /* number of threads scanning the matrix */
+	struct mih_index *mih;      /* exact index of the matrix, or NULL */
+	struct mih_workspace mih_ws;  /* memory needed to query `mih` */
+	struct ivf_index *ivf;      /* approximate index of the matrix, or NULL */
+	int nprobe;                 /* number of inverted lists scanned */
+	int recall;                 /* compare results with an exact search */
+	struct latency *lat;        /* latency of the answered queries */
+	long n_scanned;             /* vectors compared to the queries */
+};
+
+/* topk_range: give the rows of the range to the selection of each query. The
+ *             range is processed by blocks of SCAN_BLOCK rows: while a block
+ *             is in cache, it is compared to all the queries of the batch, so
+ *             the matrix is only read once from memory for the whole batch.
+ *             Used as a thread routine, so it takes and returns a void
+ *             pointer. */
+void *topk_range(void *arg)
 {
-	long i, j, index;
-	struct neighbor *topk, tmp;
+	struct scan_range *r = arg;
+	long b, n_rows;
+	int q, dist[SCAN_BLOCK];
 
-	if ((topk = calloc(k + 1, sizeof *topk)) == NULL)
+	/* distances are computed with the scan routine specialized for this
+	 * number of bits; a word cannot be its nearest neighbor so its own
+	 * row is skipped */
+	for (b = r->start; b < r->end; b += SCAN_BLOCK)
 	{
-		fprintf(stderr, "find_topk: can't allocate memory for heap\n");
+		n_rows = (r->end - b < SCAN_BLOCK) ? r->end - b : SCAN_BLOCK;
+		for (q = 0; q < r->n_queries; ++q)
+		{
+			scan_rows(r->vec + r->index[q] * r->n_long,
+			          r->vec + b * r->n_long, n_rows, r->n_long,
+			          dist);
+			select_rows(r->sel + q, dist, b, n_rows, r->index[q]);
+		}
+	}
+	return NULL;
+}
+
+/* to_neighbors: return the k neighbors selected by `sel`, with their
+ *               Sokal-Michener similarity (the same as binary_sim()). When
+ *               less than k words have a similarity greater than 0, the list
+ *               is completed with the word of index 0 and a similarity of 0. */
+struct neighbor *to_neighbors(struct selection *sel)
+{
+	struct neighbor *topk;
+	long i, n, *index;
+	int *dist;
+
+	if ((topk = calloc(sel->k + 1, sizeof *topk)) == NULL
+	 || (index = malloc(sel->k * sizeof *index + 1)) == NULL
+	 || (dist = malloc(sel->k * sizeof *dist + 1)) == NULL)
+	{
+		fprintf(stderr, "to_neighbors: can't allocate memory\n");
 		exit(1);
 	}
 
+	n = finish_selection(sel, index, dist);
+	for (i = 0; i < n; ++i)
+	{
+		topk[i].index = index[i];
+		topk[i].similarity = (sel->n_bits - dist[i])
+		                     / (float) sel->n_bits;
+	}
+
+	free(index);
+	free(dist);
+	return topk;
+}
+
+/* find_topk_batch: return the k nearest neighbors of each of the n_queries
+ *                  words whose rows are in `index`. The matrix is scanned
+ *                  once for the whole batch, by n_threads threads, each one
+ *                  scanning a range of the embedding matrix. */
+struct neighbor **find_topk_batch(const long *index, const int n_queries,
+	                          const int k, const long n_vecs,
+	                          const int n_long, const unsigned long *vec,
+	                          const int n_threads)
+{
+	int i, q, n_bits;
+	long j, n, *cand_index;
+	int *cand_dist;
+	struct selection merged;
+	struct neighbor **topk;
+	struct scan_range *ranges;
+	pthread_t *threads;
+
+	if ((ranges = calloc(n_threads, sizeof *ranges)) == NULL
+	 || (threads = calloc(n_threads, sizeof *threads)) == NULL
+	 || (topk = calloc(n_queries, sizeof *topk)) == NULL
+	 || (cand_index = malloc(k * sizeof *cand_index + 1)) == NULL
+	 || (cand_dist = malloc(k * sizeof *cand_dist + 1)) == NULL)
+	{
+		fprintf(stderr, "find_topk_batch: can't allocate memory\n");
+		exit(1);
+	}
+
+	n_bits = sizeof(long) * 8 * n_long;
+	for (i = 0; i < n_threads; ++i)
+	{
+		ranges[i].vec       = vec;
+		ranges[i].n_long    = n_long;
+		ranges[i].n_queries = n_queries;
+		ranges[i].index     = index;
+		ranges[i].start     = n_vecs * i / n_threads;
+		ranges[i].end       = n_vecs * (i+1) / n_threads;
+		if ((ranges[i].sel = calloc(n_queries, sizeof *ranges[i].sel))
+		    == NULL)
+		{
+			fprintf(stderr, "find_topk_batch: can't allocate "
+			        "memory\n");
+			exit(1);
+		}
+		for (q = 0; q < n_queries; ++q)
+			init_selection(ranges[i].sel + q, k, n_bits);
+	}
+
+	if (n_threads == 1)
+		topk_range(ranges);
+	else
+	{
+		for (i = 0; i < n_threads; ++i)
+			if (pthread_create(threads + i, NULL, topk_range,
+			                   ranges + i) != 0)
+			{
+				fprintf(stderr, "find_topk_batch: can't create "
+				        "thread\n");
+				exit(1);
+			}
+		for (i = 0; i < n_threads; ++i)
+			pthread_join(threads[i], NULL);
+	}
+
+	/* Merge the local selections: ranges are consecutive, so giving their
+	 * candidates range after range keeps them by increasing index, and ties
+	 * are ordered like with a single scan. No merge with a single thread. */
+	for (q = 0; q < n_queries; ++q)
+	{
+		if (n_threads == 1)
+		{
+			topk[q] = to_neighbors(ranges[0].sel + q);
+			continue;
+		}
+		init_selection(&merged, k, n_bits);
+		for (i = 0; i < n_threads; ++i)
+		{
+			n = finish_selection(ranges[i].sel + q, cand_index,
+			                     cand_dist);
+			for (j = 0; j < n; ++j)
+				push_candidate(&merged, cand_index[j],
+				               cand_dist[j]);
+		}
+		topk[q] = to_neighbors(&merged);
+		free_selection(&merged);
+	}
+
+	for (i = 0; i < n_threads; ++i)
+	{
+		for (q = 0; q < n_queries; ++q)
+			free_selection(ranges[i].sel + q);
+		free(ranges[i].sel);
+	}
+	free(ranges);
+	free(threads);
+	free(cand_index);
+	free(cand_dist);
+	return topk;
+}
+
+/* free_topk: free the n top-k lists of `topk` */
+void free_topk(struct neighbor **topk, const int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		free(topk[i]);
+	free(topk);
+}
+
+/* find_topk_mih: return the k nearest neighbors of the word of row `index`,
+ *                found with the multi-index hashing index */
+struct neighbor *find_topk_mih(const struct mih_index *mih,
+	                       struct mih_workspace *ws, const long index,
+	                       const int k, long *n_scanned)
+{
+	struct selection sel;
+	struct neighbor *topk;
+
+	init_selection(&sel, k, mih->n_long * sizeof(long) * 8);
+	*n_scanned += mih_search(mih, ws, index, &sel);
+	topk = to_neighbors(&sel);
+	free_selection(&sel);
+	return topk;
+}
+
+/* find_topk_ivf: return the (approximate) k nearest neighbors of the word of
+ *                row `index`, found in the nprobe closest lists of the
+ *                inverted file index */
+struct neighbor *find_topk_ivf(const struct ivf_index *ivf, const long index,
+	                       const int nprobe, const int k, long *n_scanned)
+{
+	struct selection sel;
+	struct neighbor *topk;
+
+	init_selection(&sel, k, ivf->n_long * sizeof(long) * 8);
+	*n_scanned += ivf_search(ivf, index, nprobe, &sel);
+	topk = to_neighbors(&sel);
+	free_selection(&sel);
+	return topk;
+}
+
+/* search_batch: return the k nearest neighbors of each of the n_queries words
+ *               whose rows are in `index`, with the index of `s` if it has
+ *               one, otherwise with a scan of the whole matrix. The number of
+ *               vectors compared to the queries is added to s->n_scanned. */
+struct neighbor **search_batch(struct searcher *s, const long *index,
+	                       const int n_queries, const int k)
+{
+	struct neighbor **topk;
+	int q;
+
+	if (s->mih == NULL && s->ivf == NULL)
+	{
+		s->n_scanned += n_queries * s->n_vecs;
+		return find_topk_batch(index, n_queries, k, s->n_vecs,
+		                       s->n_long, s->vec, s->n_threads);
+	}
+
+	if ((topk = calloc(n_queries, sizeof *topk)) == NULL)
+	{
+		fprintf(stderr, "search_batch: can't allocate memory\n");
+		exit(1);
+	}
+	for (q = 0; q < n_queries; ++q)
+		topk[q] = (s->mih != NULL)
+		          ? find_topk_mih(s->mih, &s->mih_ws, index[q], k,
+		                          &s->n_scanned)
+		          : find_topk_ivf(s->ivf, index[q], s->nprobe, k,
+		                          &s->n_scanned);
+	return topk;
+}
+
+/* print_recall: print the recall@k of the n_queries top-k lists of `topk`
+ *               (the fraction of the true k nearest neighbors they contain),
+ *               computed with an exact scan of the whole matrix. Padding
+ *               neighbors (similarity of 0) are not counted. */
+void print_recall(struct searcher *s, const long *index, const int n_queries,
+	          const int k, struct neighbor **topk)
+{
+	struct neighbor **exact;
+	long n_true, n_found;
+	int q, i, j;
+	double start, end;
+
+	start = wall_time();
+	exact = find_topk_batch(index, n_queries, k, s->n_vecs, s->n_long,
+	                        s->vec, s->n_threads);
+	end = wall_time();
+
+	for (q = 0, n_true = 0, n_found = 0; q < n_queries; ++q)
+		for (i = 0; i < k && exact[q][i].similarity > 0; ++i)
+		{
+			++n_true;
+			for (j = 0; j < k; ++j)
+				if (topk[q][j].similarity > 0
+				 && topk[q][j].index == exact[q][i].index)
+				{
+					++n_found;
+					break;
+				}
+		}
+
+	printf("> Recall@%d: %.4f (%ld of %ld true neighbors found, exact "
+	       "search in %.3f ms).\n", k,
+	       (n_true > 0) ? (double) n_found / n_true : 1.0, n_found, n_true,
+	       (end - start) * 1000);
+	free_topk(exact, n_queries);
+}
+
+/* find_topk: return the k nearest neighbors of word, or NULL if word has no
+ *            vector */
+struct neighbor *find_topk(struct searcher *s, const char *word, const int k)
+{
+	long index;
+	struct neighbor **batch, *topk;
+
 	/* word has no vector, can't find its neighbors */
 	if ((index = get_index(word)) < 0)
 		return NULL;
 
-	for (i = 0; i < n_vecs; ++i)
+	batch = search_batch(s, &index, 1, k);
+	topk = *batch;
+	free(batch);
+	return topk;
+}
+
+/* print_topk: print the k nearest neighbors of word */
+void print_topk(const char *word, const struct neighbor *topk, const int k)
+{
+	int i;
+
+	printf("Top %d closest words of %s\n", k, word);
+	for (i = 0; i < k; ++i)
+		printf("  %-15s %.3f\n", words[topk[i].index],
+		                         topk[i].similarity);
+}
+
+/* run_batch: answer the top-k queries whose words are read from `fp` (separated
+ *            by white spaces), processing up to `batch_size` queries with each
+ *            scan of the embedding matrix */
+void run_batch(struct searcher *s, FILE *fp, const int batch_size,
+	       const int k)
+{
+	char (*batch)[MAXLENWORD];  /* words of current batch */
+	long *index;                /* rows of the words of current batch */
+	int i, n, done;
+	struct neighbor **topk;
+	double start, end;
+
+	if ((batch = malloc(batch_size * sizeof *batch)) == NULL
+	 || (index = malloc(batch_size * sizeof *index)) == NULL)
 	{
-		/* a word cannot be its nearest neighbor; skip it */
-		if (i == index)
+		fprintf(stderr, "run_batch: can't allocate memory\n");
+		exit(1);
+	}
+
+	for (done = 0; !done; )
+	{
+		/* read the next batch; words without a vector are reported
+		 * right away and do not take a place in the batch */
+		for (n = 0; n < batch_size; )
+		{
+			if (fscanf(fp, "%255s", batch[n]) != 1)
+			{
+				done = 1;
+				break;
+			}
+			if ((index[n] = get_index(batch[n])) < 0)
+				printf("%s doesn't have a vector; can't find "
+				       "its nearest neighbors.\n\n", batch[n]);
+			else
+				++n;
+		}
+		if (n == 0)
+			break;
+
+		start = wall_time();
+		topk = search_batch(s, index, n, k);
+		end = wall_time();
+		record_latency(s->lat, end - start, n, s->n_scanned);
+		s->n_scanned = 0;
+
+		for (i = 0; i < n; ++i)
+		{
+			print_topk(batch[i], topk[i], k);
+			printf("\n");
+		}
+		printf("> Batch of %d queries processed in %.3f ms.\n", n,
+		       (end - start) * 1000);
+		if (s->recall)
+			print_recall(s, index, n, k, topk);
+		printf("\n");
+		free_topk(topk, n);
+	}
+
+	free(batch);
+	free(index);
+}
+
+/* serve_stream: answer the requests read from `in` until its end, writing the
+ *               responses to `out`. Each request is a line "WORD [K]" (K is
+ *               default_k if not given); its response is either the line
+ *               "OK K" followed by K lines "NEIGHBOR SIMILARITY", or a line
+ *               "ERR MESSAGE". */
+void serve_stream(struct searcher *s, FILE *in, FILE *out,
+	          const int default_k)
+{
+	char line[MAXLENLINE], word[MAXLENWORD];
+	struct neighbor *topk;
+	int i, k, n;
+	double start;
+
+	while (fgets(line, MAXLENLINE, in) != NULL)
+	{
+		/* skip empty lines, reject lines too long for the buffer */
+		if ((n = sscanf(line, "%255s %d", word, &k)) < 1)
 			continue;
+		start = wall_time();
+		if (strchr(line, '\n') == NULL && !feof(in))
+		{
+			while ((i = fgetc(in)) != EOF && i != '\n')
+				;
+			fprintf(out, "ERR request too long\n");
+		}
+		else if (n == 1 && (k = default_k) < 1)
+			fprintf(out, "ERR K must be given\n");
+		else if (k < 1 || k > s->n_vecs)
+			fprintf(out, "ERR K must be between 1 and %ld\n",
+			        s->n_vecs);
+		else if ((topk = find_topk(s, word, k)) == NULL)
+			fprintf(out, "ERR %s doesn't have a vector\n", word);
+		else
+		{
+			record_latency(s->lat, wall_time() - start, 1,
+			               s->n_scanned);
+			s->n_scanned = 0;
+			fprintf(out, "OK %d\n", k);
+			for (i = 0; i < k; ++i)
+				fprintf(out, "%s %.3f\n", words[topk[i].index],
+				        topk[i].similarity);
+			free(topk);
+		}
+		if (fflush(out) == EOF) /* client is gone */
+			break;
+	}
+}
+
+/* worker of server mode. Workers share the read-only matrix, index and hash
+ * table without locks; each one has its own copy of the searcher (so its own
+ * index workspace). */
+struct worker
+{
+	struct searcher s;
+	int listen_fd;              /* socket to accept connections on */
+	int conn_fd;                /* connection being served, -1 if none */
+	int default_k;              /* K of the requests that don't give it */
+};
 
-		/* values in topk are sorted by decreasing similarity. If the
-		 * similarity with current vector is greater than minimal
-		 * similarity in topk, insert current similarity into topk with
-		 * bubble sort */
-		topk[k].similarity = binary_sim(vec[index], vec[i], n_long);
-		if (topk[k].similarity < topk[k-1].similarity)
+/* stopping is set by serve() when the server is asked to stop; it and the
+ * conn_fd of the workers are protected by conn_lock */
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stopping;
+
+/* server_worker: accept the connections of the listening socket and answer
+ *                their requests, one connection at a time. Used as a thread
+ *                routine, so it takes and returns a void pointer. */
+
+void *server_worker(void *arg)
+{
+	struct worker *w = arg;
+	FILE *in, *out;
+	int fd, out_fd;
+
+	for (;;)
+	{
+		/* the socket has been shut down by serve(): stop; out of
+		 * descriptors: wait for a client to leave before retrying */
+		if ((fd = accept(w->listen_fd, NULL, NULL)) < 0)
+		{
+			if (errno == EBADF || errno == EINVAL)
+				break;
+			if (errno == EMFILE || errno == ENFILE
+			 || errno == ENOBUFS || errno == ENOMEM)
+				sleep(1);
 			continue;
+		}
 
-		for (topk[k].index = i, j = k;
-		     j > 0 && topk[j].similarity > topk[j-1].similarity;
-		     --j)
+		/* a connection accepted while stopping is not served */
+		pthread_mutex_lock(&conn_lock);
+		if (!stopping)
+			w->conn_fd = fd;
+		pthread_mutex_unlock(&conn_lock);
+		if (w->conn_fd < 0)
 		{
-			/* swap element j-1 with element j */
-			tmp = topk[j-1];
-			topk[j-1] = topk[j];
-			topk[j] = tmp;
+			close(fd);
+			break;
 		}
+
+		/* each stream has its own descriptor, so each one can be
+		 * closed; close whatever has been opened if one fails */
+		in = fdopen(fd, "r");
+		out_fd = (in != NULL) ? dup(fd) : -1;
+		out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+		if (out == NULL)
+		{
+			fprintf(stderr, "server_worker: can't open connection "
+			        "stream\n");
+			if (out_fd >= 0)
+				close(out_fd);
+			if (in != NULL)
+				fclose(in);
+			else
+				close(fd);
+			continue;
+		}
+		serve_stream(&w->s, in, out, w->default_k);
+		pthread_mutex_lock(&conn_lock);
+		w->conn_fd = -1;
+		pthread_mutex_unlock(&conn_lock);
+		fclose(in);
+		fclose(out);
 	}
-	return topk;
+	return NULL;
+}
+
+/* serve: answer the requests of the standard input on the standard output,
+ *        or, if socket_path is not NULL, the requests of the clients
+ *        connecting to the Unix domain socket socket_path, with a pool of
+ *        n_threads workers, until the process receives SIGINT or SIGTERM */
+void serve(struct searcher *s, const char *socket_path, const int default_k)
+{
+	struct sockaddr_un addr;
+	struct worker *workers;
+	pthread_t *threads;
+	sigset_t stop;
+	int i, n_workers, fd, sig;
+
+	/* a single stream, searches can use all the threads */
+	if (socket_path == NULL)
+	{
+		serve_stream(s, stdin, stdout, default_k);
+		return;
+	}
+
+	/* a client closing its connection must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof addr.sun_path)
+	{
+		fprintf(stderr, "serve: socket path too long\n");
+		exit(1);
+	}
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	 || bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0
+	 || listen(fd, SOMAXCONN) < 0)
+	{
+		fprintf(stderr, "serve: can't listen on %s\n", socket_path);
+		exit(1);
+	}
+
+	n_workers = s->n_threads;
+	if ((workers = calloc(n_workers, sizeof *workers)) == NULL
+	 || (threads = calloc(n_workers, sizeof *threads)) == NULL)
+	{
+		fprintf(stderr, "serve: can't allocate memory\n");
+		exit(1);
+	}
+
+	/* the stop signals are blocked in all threads (they inherit the mask)
+	 * and waited for by this one, so it can report the latencies */
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+	/* each worker answers its requests with a single thread */
+	for (i = 0; i < n_workers; ++i)
+	{
+		workers[i].s = *s;
+		workers[i].s.n_threads = 1;
+		workers[i].s.recall = 0;
+		if (i > 0 && s->mih != NULL)
+			init_mih_workspace(&workers[i].s.mih_ws, s->mih);
+		workers[i].listen_fd = fd;
+		workers[i].conn_fd = -1;
+		workers[i].default_k = default_k;
+		if (pthread_create(threads + i, NULL, server_worker,
+		                   workers + i) != 0)
+		{
+			fprintf(stderr, "serve: can't create thread\n");
+			exit(1);
+		}
+	}
+	fprintf(info, "> Serving on %s with %d workers.\n", socket_path,
+	        n_workers);
+
+	/* workers are blocked in accept() or serving a client. Shutting down
+	 * the socket wakes the former; the latter stop reading from their
+	 * client but finish the requests already received, so all of them are
+	 * counted once the workers are joined */
+	sigwait(&stop, &sig);
+	pthread_mutex_lock(&conn_lock);
+	stopping = 1;
+	for (i = 0; i < n_workers; ++i)
+		if (workers[i].conn_fd >= 0)
+			shutdown(workers[i].conn_fd, SHUT_RD);
+	pthread_mutex_unlock(&conn_lock);
+	shutdown(fd, SHUT_RDWR);
+	for (i = 0; i < n_workers; ++i)
+	{
+		pthread_join(threads[i], NULL);
+		if (i > 0 && s->mih != NULL)
+			free_mih_workspace(&workers[i].s.mih_ws);
+	}
+	close(fd);
+	unlink(socket_path);
+	free(workers);
+	free(threads);
+}
+
+/* load_index: build the index of `s` (or load it from "EMBEDDING.mih" if it has
+ *             been saved for these vectors). If `save` is set, write it to
+ *             this file once built. */
+void load_index(struct searcher *s, const char *embedding_file,
+	        const int sub_bits, const int save)
+{
+	char *filename;
+	double start, end;
+
+	if ((filename = malloc(strlen(embedding_file) + 5)) == NULL)
+	{
+		fprintf(stderr, "load_index: can't allocate memory\n");
+		exit(1);
+	}
+	strcpy(filename, embedding_file);
+	strcat(filename, ".mih");
+
+	start = wall_time();
+	if ((s->mih = load_mih(filename, s->vec, s->n_vecs, s->n_long)) == NULL)
+	{
+		s->mih = build_mih(s->vec, s->n_vecs, s->n_long, sub_bits);
+		if (save)
+			save_mih(s->mih, filename);
+	}
+	end = wall_time();
+	fprintf(info, "> Multi-index hashing index (%d tables of %d bits) "
+	        "ready in %.3f s.\n\n", s->mih->n_tables, s->mih->sub_bits,
+	        end - start);
+
+	init_mih_workspace(&s->mih_ws, s->mih);
+	free(filename);
+}
+
+/* load_ivf: build the inverted file index of `s`, with n_lists lists (about
+ *           the square root of the number of vectors if n_lists is 0) */
+void load_ivf(struct searcher *s, int n_lists)
+{
+	double start, end;
+
+	if (n_lists <= 0)
+		for (n_lists = 1; (long) n_lists * n_lists < s->n_vecs; )
+			++n_lists;
+
+	start = wall_time();
+	s->ivf = build_ivf(s->vec, s->n_vecs, s->n_long, n_lists, IVF_ITER);
+	end = wall_time();
+	fprintf(info, "> Inverted file index (%d lists, %d probed) ready in "
+	        "%.3f s.\n\n", s->ivf->n_lists, s->nprobe, end - start);
 }
 
 int main(int argc, char *argv[])
 {
-	int n_bits, n_long;         /* #bits per vector, #long per array */
-	long n_vecs;                /* #vectors in embedding file */
-	unsigned long **embedding;
+	int n_bits;                 /* #bits per vector */
+	unsigned long *embedding;
+	struct searcher s;          /* matrix (and index) to search */
 	struct neighbor *topk;
-	int i, k;
-	clock_t start, end;
+	int k, batch_size, use_mih, mih_bits, save_index, use_ivf, n_lists;
+	long index;
+	char *batch_file;           /* file of queries, NULL to use argv */
+	char *socket_path;          /* socket of server mode, NULL for stdin */
+	int server;                 /* run as a server */
+	struct latency lat;         /* latency of all the queries */
+	int json;                   /* print the latencies as JSON */
+	FILE *fp;
+	double start, end;
+
+	/* parse optional flags, given before the positional arguments */
+	s.n_threads = 1;
+	s.mih       = NULL;
+	s.ivf       = NULL;
+	s.nprobe    = 8;
+	s.recall    = 0;
+	s.lat       = &lat;
+	s.n_scanned = 0;
+	json        = 0;
+	batch_file  = NULL;
+	server      = 0;
+	socket_path = NULL;
+	info        = stdout;
+	batch_size  = 256;
+	use_mih     = 0;
+	mih_bits    = 0;
+	save_index  = 0;
+	use_ivf     = 0;
+	n_lists     = 0;
+	for (; argc > 1 && argv[1][0] == '-'; --argc, ++argv)
+	{
+		if (strcmp(argv[1], "-interleave") == 0)
+			numa_interleave = 1;
+		else if (strcmp(argv[1], "-threads") == 0 && argc > 2)
+		{
+			if ((s.n_threads = atoi(argv[2])) < 1)
+				s.n_threads = 1;
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-batch") == 0 && argc > 2)
+		{
+			batch_file = argv[2];
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-batch-size") == 0 && argc > 2)
+		{
+			if ((batch_size = atoi(argv[2])) < 1)
+				batch_size = 1;
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-index") == 0 && argc > 2)
+		{
+			if (strcmp(argv[2], "mih") == 0)
+				use_mih = 1;
+			else if (strcmp(argv[2], "ivf") == 0)
+				use_ivf = 1;
+			else if (strcmp(argv[2], "none") != 0)
+				fprintf(stderr, "main: unknown index %s\n",
+				        argv[2]);
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-mih-bits") == 0 && argc > 2)
+		{
+			mih_bits = atoi(argv[2]);
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-save-index") == 0)
+			save_index = 1;
+		else if (strcmp(argv[1], "-nlist") == 0 && argc > 2)
+		{
+			n_lists = atoi(argv[2]);
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-nprobe") == 0 && argc > 2)
+		{
+			if ((s.nprobe = atoi(argv[2])) < 1)
+				s.nprobe = 1;
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else if (strcmp(argv[1], "-recall") == 0)
+			s.recall = 1;
+		else if (strcmp(argv[1], "-serve") == 0)
+		{
+			server = 1;
+			info = stderr;
+		}
+		else if (strcmp(argv[1], "-json") == 0)
+			json = 1;
+		else if (strcmp(argv[1], "-socket") == 0 && argc > 2)
+		{
+			socket_path = argv[2];
+			--argc, ++argv; /* one more argument has been used */
+		}
+		else
+			fprintf(stderr, "main: unknown flag %s\n", argv[1]);
+	}
 
-	if (argc < 4)
+	if (argc < (batch_file == NULL && !server ? 4 : 3))
 	{
-		printf("usage: ./topk_binary EMBEDDING K QUERY...\n");
+		printf("usage: ./topk_binary [-interleave] [-threads N] "
+		       "[-index mih [-mih-bits B] [-save-index]]\n"
+		       "                     [-index ivf [-nlist L] [-nprobe P]] "
+		       "[-recall] [-json] EMBEDDING K QUERY...\n"
+		       "       ./topk_binary [...] -batch FILE [-batch-size Q] "
+		       "EMBEDDING K\n"
+		       "       ./topk_binary [...] -serve [-socket PATH] "
+		       "EMBEDDING K\n");
 		exit(1);
 	}
 
-	embedding = load_vectors(*++argv, &n_vecs, &n_bits, &n_long, 1);
+	embedding = load_vectors(*++argv, &s.n_vecs, &n_bits, &s.n_long, NULL,
+	                         1);
+	s.vec = embedding;
+	if (use_mih)
+		load_index(&s, *argv, mih_bits, save_index);
+	else if (use_ivf)
+		load_ivf(&s, n_lists);
 	k = atoi(*++argv);
 	argc -= 2; /* because already used argument 0 and 1 */
 
+	/* requests are answered until the end of the standard input, or forever
+	 * on a socket */
+	if (server)
+	{
+		init_latency(&lat);
+		serve(&s, socket_path, k);
+		print_latency(&lat, info, json);
+		return 0;
+	}
+
+	/* queries are read from a file ("-" for the standard input) */
+	if (batch_file != NULL)
+	{
+		if (strcmp(batch_file, "-") == 0)
+			fp = stdin;
+		else if ((fp = fopen(batch_file, "r")) == NULL)
+		{
+			fprintf(stderr, "main: can't open %s\n", batch_file);
+			exit(1);
+		}
+		init_latency(&lat);
+		run_batch(&s, fp, batch_size, k);
+		if (fp != stdin)
+			fclose(fp);
+		print_latency(&lat, info, json);
+		return 0;
+	}
+
+	init_latency(&lat);
 	while (--argc > 0)
 	{
-		start = clock();
-		topk = find_topk(*++argv, k, n_vecs, n_long, embedding);
-		end = clock();
+		start = wall_time();
+		topk = find_topk(&s, *++argv, k);
+		end = wall_time();
+		record_latency(s.lat, end - start, topk != NULL, s.n_scanned);
+		s.n_scanned = 0;
 
 		if (topk == NULL)
 		{
@@ -106,14 +877,15 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
-		printf("Top %d closest words of %s\n", k, *argv);
-		for (i = 0; i < k; ++i)
-			printf("  %-15s %.3f\n", words[topk[i].index],
-			                         topk[i].similarity);
+		print_topk(*argv, topk, k);
 		printf("> Query processed in %.3f ms.\n",
-		       (double) (end - start) * 1000 / CLOCKS_PER_SEC);
+		       (end - start) * 1000);
+		if (s.recall && (index = get_index(*argv)) >= 0)
+			print_recall(&s, &index, 1, k, &topk);
 		printf("\n");
+		free(topk);
 	}
+	print_latency(&lat, info, json);
 
 	return 0;
 }
@@ -19,19 +19,198 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* Packed binary format of binary vectors, written by `binarize -format bin`
+ * and detected by load_vectors(). The file starts with a `struct bin_header`,
+ * followed (at offset `codes_offset`, a multiple of BIN_ALIGN) by the
+ * contiguous (n_vecs, n_bits/64) matrix of `unsigned long`, then by the word
+ * section: the `n_vecs` words, in the same order as the matrix rows, each one
+ * terminated by a null character. All integers are stored in the byte order of
+ * the machine that wrote the file (given by `endian`). */
+#define BIN_MAGIC   "NLBINVEC"  /* first 8 bytes of a packed file */
+#define BIN_VERSION 1           /* current version of the packed format */
+#define BIN_ENDIAN  0x01020304  /* reads differently on other byte orders */
+#define BIN_ALIGN   64          /* alignment of the code matrix in file */
+
+struct bin_header
+{
+	char magic[8];          /* BIN_MAGIC, without the null character */
+	unsigned int version;   /* BIN_VERSION */
+	unsigned int endian;    /* BIN_ENDIAN */
+	long n_vecs;            /* number of binary vectors */
+	long n_bits;            /* number of bits of each vector */
+	long codes_offset;      /* position of the code matrix in file */
+	long words_offset;      /* position of the word section in file */
+	long words_size;        /* size (in bytes) of the word section */
+};
+
 /* hashtab.c */
 extern long n_words;            /* counter of the number of words in hashtab */
 extern char **words;            /* to convert an index to a word */
 long get_index(const char*);
-void add_word(const char*, const int);
+long add_word(const char*, const int);
+void reserve_words(const long);
+void clear_hashtab(void);
 void lower(char*);
 
+/* hamming.c */
+extern int (*hamming)(const unsigned long*, const unsigned long*, const int);
+extern const char *hamming_name;
+extern void (*scan_rows)(const unsigned long*, const unsigned long*,
+                         const long, const int, int*);
+int hamming_scalar(const unsigned long*, const unsigned long*, const int);
+void scan_generic(const unsigned long*, const unsigned long*, const long,
+                  const int, int*);
+void init_hamming(const int);
+void init_scan(const int);
+
+/* selection.c */
+struct selection
+{
+	int k;                  /* number of candidates to select */
+	int n_bits;             /* distances are in [0, n_bits] */
+	int threshold;          /* largest distance still accepted */
+	long n_kept;            /* #candidates with distance <= threshold */
+	long *hist;             /* #candidates kept for each distance */
+	long n_cand, max_cand;  /* #candidates in buffer, its capacity */
+	long *cand_index;       /* buffer of candidates (index, distance) */
+	int *cand_dist;
+};
+void init_selection(struct selection*, const int, const int);
+void free_selection(struct selection*);
+void push_candidate(struct selection*, const long, const int);
+void select_rows(struct selection*, const int*, const long, const long,
+                 const long);
+long finish_selection(struct selection*, long*, int*);
+
+/* mih.c */
+struct mih_table
+{
+	unsigned long size;     /* number of slots (a power of 2) */
+	unsigned int *keys;     /* substring value of each slot */
+	unsigned int *start;    /* position in `ids` of the bucket of each slot */
+	unsigned int *count;    /* size of the bucket of each slot, 0 if empty */
+	unsigned int *ids;      /* all rows, grouped by substring value */
+};
+struct mih_index
+{
+	const unsigned long *vec;  /* the indexed (n_vecs, n_long) matrix */
+	long n_vecs;
+	int n_long;
+	int sub_bits;           /* number of bits of each substring */
+	int n_tables;           /* number of substrings (one table each) */
+	struct mih_table *tables;
+};
+struct mih_candidate
+{
+	long index;
+	int dist;
+};
+struct mih_workspace
+{
+	unsigned int *seen;     /* rows already seen during current query */
+	unsigned int stamp;     /* value of `seen` for current query */
+	struct mih_candidate *cand;  /* rows seen, with their distance */
+	long n_cand, max_cand;
+	long *hist;             /* number of candidates for each distance */
+	int radius;             /* radius needed by the previous query */
+};
+struct mih_index *build_mih(const unsigned long*, const long, const int, int);
+void free_mih(struct mih_index*);
+void save_mih(const struct mih_index*, const char*);
+struct mih_index *load_mih(const char*, const unsigned long*, const long,
+                           const int);
+void init_mih_workspace(struct mih_workspace*, const struct mih_index*);
+void free_mih_workspace(struct mih_workspace*);
+long mih_search(const struct mih_index*, struct mih_workspace*, const long,
+                struct selection*);
+
+/* ivf.c */
+struct ivf_index
+{
+	const unsigned long *vec;  /* the indexed (n_vecs, n_long) matrix */
+	long n_vecs;
+	int n_long;
+	int n_lists;            /* number of inverted lists */
+	unsigned long *centroids;  /* (n_lists, n_long) centroid of each list */
+	long *list_start;       /* list i is rows list_start[i], ...,
+	                           list_start[i+1]-1 of `codes` and `ids` */
+	unsigned long *codes;   /* the vectors, grouped by list */
+	long *ids;              /* row in `vec` of each row of `codes` */
+};
+struct ivf_index *build_ivf(const unsigned long*, const long, const int, int,
+                            const int);
+void free_ivf(struct ivf_index*);
+long ivf_search(const struct ivf_index*, const long, int, struct selection*);
+
+/* latency.c */
+#define LAT_SUB     32          /* buckets per power of 2 of the histogram */
+#define LAT_BUCKETS (60 * LAT_SUB)  /* enough for any 64-bit latency */
+struct latency
+{
+	long count[LAT_BUCKETS];  /* number of queries of each bucket */
+	long n_queries;         /* number of recorded queries */
+	long n_rows;            /* vectors compared to a query, for all queries */
+	double start;           /* wall_time() when recording started */
+};
+double wall_time(void);
+void init_latency(struct latency*);
+void record_latency(struct latency*, const double, const long, const long);
+void print_latency(const struct latency*, FILE*, const int);
+
+/* embedding.c */
+#define STORAGE_FP32 0          /* how a matrix is stored in memory */
+#define STORAGE_FP16 1          /* IEEE half precision floats */
+#define STORAGE_BF16 2          /* the 16 upper bits of floats */
+#define STORAGE_INT8 3          /* integers in [-127, 127], times a per-row
+                                   scale */
+struct vec_source               /* gives the rows of the training vectors */
+{
+	long n_vecs;
+	int n_dims;
+	const float *vec;       /* the whole matrix if in memory, or NULL */
+	char **words;           /* and its words (or NULL) */
+	int storage;            /* STORAGE_FP32, or format of `data` */
+	void *data;             /* the whole matrix in reduced precision */
+	float *scale;           /* scale of each row (STORAGE_INT8) */
+	int fd;                 /* otherwise, the float cache */
+	long vec_offset;        /* position of the matrix in the cache */
+	float *window;          /* rows window_first, ..., of the matrix (or
+	                           rows widened from `data`) */
+	long window_size, window_first, window_n;
+	FILE *words_fp;         /* next word of the cache to read */
+	long words_offset;      /* position of the first word in the cache */
+	long next_word, max_words;
+	char **word_ptrs, *word_buf;  /* words of the last get_words() (or
+	                                 all words of a mapped cache) */
+	size_t word_buf_size;
+	void *map;              /* the whole cache, if mapped in memory */
+	size_t map_size;
+};
+float parse_float(const char*, const char*, const char**);
+float *load_embedding(const char*, char***, long*, int*, int);
+void destroy_word_list(char**);
+int read_embedding_size(FILE*, const char*, long*, int*);
+long read_vectors(FILE*, char**, float*, long, int, int);
+void write_cache(const char*, const char*);
+void memory_source(struct vec_source*, const float*, char**, const long,
+                   const int);
+void open_cache(struct vec_source*, const char*, long);
+int parse_storage(const char*);
+void compact_source(struct vec_source*, struct vec_source*, const int,
+                    const long);
+void close_source(struct vec_source*);
+const float *get_rows(struct vec_source*, const long, const long);
+char **get_words(struct vec_source*, const long, const long);
+
 /* spearman.c */
 float spearman_coef(float*, float*, int);
 
 /* file_process.c */
+extern int numa_interleave;     /* interleave matrix pages on NUMA nodes */
 void create_vocab(const char*);
-unsigned long **load_vectors(const char*, long*, int*, int*, int);
-void evaluate(const char*, void**, int,
+void *alloc_matrix(size_t);
+void free_matrix(void*, size_t);
+unsigned long *load_vectors(const char*, long*, int*, int*, char**, int);
+void evaluate(const char*, const unsigned long*, const char*, int,
               float (*f)(const void*, const void*, const int));
 float binary_sim(const void*, const void*, const int);